@@ -0,0 +1,237 @@
+/*	bench.c
+
+	Multi-threaded stress test and throughput benchmark of the file
+	system. Each thread opens a session of its own and works in its own
+	directory: it writes and reads back a file, and creates, stats and
+	unlinks small files, naming them by paths relative to its working
+	directory. Every run ends with fs_fsck, checking that the file system
+	is consistent and that no inode or block was leaked.
+
+	The runs are repeated with a file system per thread, each one mounted
+	from an image of its own. Every file system is mounted in the given
+	durability mode, fsync by default, and the threads sync their file
+	every few rounds.
+
+	Usage: fsbench [rounds] [none|fsync|periodic|op]
+*/
+
+#include "util.h"
+#include "common.h"
+#include "fs.h"
+#include "fsUtil.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_THREADS 8
+#define IO_SIZE (8 * BLOCK_SIZE)	// bytes written and read per round
+#define IO_SLOTS 16			// distinct offsets written by each thread
+#define META_EVERY 4			// rounds between metadata operations
+
+// Thread of a run, on a file system shared or of its own, where it opens
+// its session
+typedef struct {
+	fs_t *fs;
+	int id;
+} worker_t;
+
+static int rounds = 200;
+static int durability = FS_MOUNT_DURABLE_FSYNC;
+static int errors;
+static long long bytes_done;
+static long long ops_done;
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(int id, char *what) {
+	printf("thread %d: %s failed\n", id, what);
+	__sync_add_and_fetch(&errors, 1);
+}
+
+static void *worker(void *arg) {
+	fs_t *fs;
+	int id = ((worker_t *) arg)->id;
+	char dir[MAX_FILE_NAME], name[MAX_FILE_NAME], tmp[3 * MAX_FILE_NAME];
+	char wbuf[IO_SIZE], rbuf[IO_SIZE];
+	fs_off_t offset;
+	fileStat st;
+	int fd, tfd, i, r;
+	long long bytes = 0, ops = 0;
+
+	fs = fs_session_open(((worker_t *) arg)->fs);
+	snprintf(dir, sizeof(dir), "d%d", id);
+	if (fs == NULL || fs_mkdir(fs, dir) < 0 || fs_cd(fs, dir) < 0) {
+		fail(id, "session");
+		return NULL;
+	}
+
+	snprintf(name, sizeof(name), "b%d", id);
+	fd = fs_open(fs, name, FS_O_RDWR);
+	if (fd < 0) {
+		fail(id, "open");
+		return NULL;
+	}
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < IO_SIZE; i++)
+			wbuf[i] = (char) (id * 31 + r + i);
+		offset = (fs_off_t) (r % IO_SLOTS) * IO_SIZE;
+
+		if (fs_pwrite64(fs, fd, wbuf, IO_SIZE, offset) != IO_SIZE)
+			fail(id, "pwrite");
+		if (fs_pread64(fs, fd, rbuf, IO_SIZE, offset) != IO_SIZE)
+			fail(id, "pread");
+		for (i = 0; i < IO_SIZE; i++) {
+			if (rbuf[i] != wbuf[i]) {
+				fail(id, "verify");
+				break;
+			}
+		}
+		bytes += 2 * IO_SIZE;
+		ops += 2;
+
+		if (r % META_EVERY == 0) {
+			snprintf(tmp, sizeof(tmp), "t%d_%d", id, r);
+			tfd = fs_open(fs, tmp, FS_O_WRONLY);
+			if (tfd < 0 || fs_write(fs, tfd, tmp, 4) != 4 || fs_close(fs, tfd) < 0)
+				fail(id, "create");
+			snprintf(tmp, sizeof(tmp), "../%s/t%d_%d", dir, id, r);
+			if (fs_stat(fs, tmp, &st) < 0 || st.size != 4)
+				fail(id, "stat");
+			if (fs_unlink(fs, tmp) < 0)
+				fail(id, "unlink");
+			if (fs_fsync(fs, fd) < 0)
+				fail(id, "fsync");
+			ops += 6;
+		}
+	}
+
+	if (fs_close(fs, fd) < 0 || fs_unlink(fs, name) < 0)
+		fail(id, "close");
+	if (fs_cd(fs, "/") < 0 || fs_rmdir(fs, dir) < 0 || fs_session_close(fs) < 0)
+		fail(id, "rmdir");
+
+	__sync_add_and_fetch(&bytes_done, bytes);
+	__sync_add_and_fetch(&ops_done, ops);
+	return NULL;
+}
+
+// Checks that every file is gone, only the root directory is left, and
+// that the file system is consistent
+static void check_empty(fs_t *fs, int nthreads) {
+	fsCheck check;
+
+	fs_reclaim(fs, -1);
+	if (fs_fsck(fs, &check, 0) < 0 || check.errors != 0) {
+		printf("%d threads: fsck found %d errors\n", nthreads, check.errors);
+		errors++;
+	}
+	if (check.inodes_allocated != 1 || check.blocks_allocated != 1) {
+		printf("%d threads: leaked %d inodes, %d blocks\n", nthreads,
+		       check.inodes_allocated - 1, check.blocks_allocated - 1);
+		errors++;
+	}
+}
+
+// Writes everything back and adds up the device writes of a file system
+// and the blocks they wrote
+static void count_writes(fs_t *fs, int *writes, int *blocks) {
+	fs_sync(fs);
+	*writes += fs->mount->dev.dev_writes;
+	*blocks += fs->mount->dev.dev_blocks;
+}
+
+/*	Runs nthreads workers, all of them on the given file system, or each
+	one on an image of its own if fs is NULL.
+*/
+static void run(fs_t *fs, int nthreads) {
+	pthread_t threads[MAX_THREADS];
+	worker_t workers[MAX_THREADS];
+	char image[32];
+	double start, secs;
+	int i, writes = 0, blocks = 0;
+
+	for (i = 0; i < nthreads; i++) {
+		workers[i].id = i;
+		workers[i].fs = fs;
+		if (fs == NULL) {
+			snprintf(image, sizeof(image), "./disk.%d", i);
+			workers[i].fs = fs_mount(image, FS_MOUNT_FORMAT | durability);
+			if (workers[i].fs == NULL || fs_mkfs(workers[i].fs) < 0) {
+				printf("cannot mount %s\n", image);
+				exit(1);
+			}
+		}
+	}
+
+	if (fs != NULL) {
+		count_writes(fs, &writes, &blocks);
+		writes = -writes;
+		blocks = -blocks;
+	}
+
+	bytes_done = ops_done = 0;
+	start = now();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, worker, &workers[i]);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	secs = now() - start;
+
+	if (fs != NULL) {
+		check_empty(fs, nthreads);
+		count_writes(fs, &writes, &blocks);
+	} else {
+		for (i = 0; i < nthreads; i++) {
+			check_empty(workers[i].fs, nthreads);
+			count_writes(workers[i].fs, &writes, &blocks);
+			fs_umount(workers[i].fs);
+		}
+	}
+
+	printf("%d threads%s: %.3fs, %.1f MB/s, %.0f ops/s, %.1f blocks per device write\n",
+	       nthreads, fs ? "" : ", an image each", secs,
+	       bytes_done / secs / (1 << 20), ops_done / secs,
+	       writes ? (double) blocks / writes : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+	fs_t *fs;
+	int n;
+
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+	if (argc > 2) {
+		if (same_string(argv[2], "none"))
+			durability = FS_MOUNT_DURABLE_NONE;
+		else if (same_string(argv[2], "periodic"))
+			durability = FS_MOUNT_DURABLE_PERIODIC;
+		else if (same_string(argv[2], "op"))
+			durability = FS_MOUNT_DURABLE_OP;
+		else if (!same_string(argv[2], "fsync")) {
+			printf("unknown durability mode %s\n", argv[2]);
+			return 1;
+		}
+	}
+
+	fs = fs_mount("./disk", FS_MOUNT_FORMAT | durability);
+	if (fs == NULL || fs_mkfs(fs) < 0) {
+		printf("cannot mount ./disk\n");
+		return 1;
+	}
+
+	for (n = 1; n <= MAX_THREADS; n *= 2)
+		run(fs, n);
+	for (n = 1; n <= MAX_THREADS; n *= 2)
+		run(NULL, n);
+	fs_umount(fs);
+
+	printf(errors ? "FAILED, %d errors\n" : "OK\n", errors);
+	return errors != 0;
+}
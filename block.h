@@ -1,13 +1,81 @@
 #ifndef BLOCK_INCLUDED
 #define BLOCK_INCLUDED
 
+#include "lock.h"
+
 #define BLOCK_SIZE_BITS 9
 #define BLOCK_SIZE (1 << BLOCK_SIZE_BITS)
 #define BLOCK_MASK (BLOCK_SIZE-1)
+#define MAX_BLOCKS 0x7FFFFFFF // block numbers are ints
+
+#define CACHE_BLOCKS 256 // Number of blocks kept in memory by the block cache
+#define CACHE_BUCKETS 512 // Number of hash buckets of the block cache
+#define DIRTY_BACKGROUND 64 // Dirty blocks at which the flusher writes all of them back
+#define DIRTY_LIMIT 128 // Dirty blocks at which writers wait for the flusher
+#define DIRTY_EXPIRE_MS 500 // Age at which a dirty block is written back
+#define FLUSH_INTERVAL_MS 100 // Period at which the flusher looks for expired blocks
+#define FLUSH_BATCH 32 // Blocks copied out of the cache at once by a flush
+
+typedef struct {
+	int block;		// device block held, -1 if the entry is free
+	int pins;		// number of users holding the data in place
+	int held;		// pins taken by block_pin, see block_pinned
+	int loading;	// data is being read from the device
+	int dirty;		// data written to the cache only, see block_write
+	int writing;	// data is being written back to the device
+	uint64_t dirtied;	// time it became dirty, in ms
+	int prev, next;	// LRU list, most recently used first
+	int hnext;		// next entry of the same hash bucket
+	char data[BLOCK_SIZE];
+} cache_entry_t;
+
+// A device and the cache of its blocks
+typedef struct {
+	int fd;			// device, for the backend
+	cache_entry_t cache[CACHE_BLOCKS];
+	int buckets[CACHE_BUCKETS];
+	int lru_head, lru_tail;
+	mutex_t lock;
+	cond_t loaded;
+
+	int ndirty;		// entries dirty
+	int nwriting;	// entries being written back
+	cond_t flushed;	// broadcast when written back blocks reach the device
+	cond_t flush_wake;	// wakes the flusher up before its period
+	thread_t flusher;
+	int stopping;	// the flusher exits
+	int flush_period_ms;	// the flusher flushes the device this often, 0 if never
+	int unflushed;	// blocks written since the device was last flushed
+	uint64_t flushed_at;	// time the device was last flushed, in ms
+
+	int dev_writes;	// writes issued to the device
+	int dev_blocks;	// blocks written by them
+} blockdev_t;
 
 void bzero_block( char *block);
-void block_init( void);
-void block_read( int block, char *mem);
-void block_write( int block, char *mem);
+int block_open( blockdev_t *dev, char *path, int flush_period_ms);
+void block_close( blockdev_t *dev);
+void block_read( blockdev_t *dev, int block, char *mem);
+void block_write( blockdev_t *dev, int block, char *mem);
+void block_write_through( blockdev_t *dev, int block, char *mem);
+void block_barrier( blockdev_t *dev);
+void block_sync( blockdev_t *dev);
+void block_zero_all( blockdev_t *dev, int nblocks);
+void block_discard( blockdev_t *dev, int block, int count);
+void block_truncate( blockdev_t *dev, int nblocks);
+void block_flush( blockdev_t *dev, int data_only);
+char *block_pin( blockdev_t *dev, int block);
+void block_unpin( blockdev_t *dev, int block);
+int block_pinned( blockdev_t *dev, int block);
+
+// Device backend, only used by the block cache
+int dev_open( blockdev_t *dev, char *path);
+void dev_close( blockdev_t *dev);
+void dev_read( blockdev_t *dev, int block, char *mem);
+void dev_write( blockdev_t *dev, int block, char *mem);
+void dev_write_blocks( blockdev_t *dev, int block, int count, char *mem);
+void dev_flush( blockdev_t *dev, int data_only);
+void dev_truncate( blockdev_t *dev, int nblocks);
+void dev_discard( blockdev_t *dev, int block, int count);
 
 #endif
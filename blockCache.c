@@ -0,0 +1,557 @@
+/*	blockCache.c
+
+	Write-back cache of device blocks. Recently used blocks are kept in
+	memory, so reading them again costs no device I/O. Blocks may be
+	pinned, which keeps them in place until they are unpinned. Each
+	device opened has a cache of its own.
+
+	Writes only reach the cache, the blocks are marked dirty and written
+	back later by a flusher thread of the device, in block order: the
+	ones dirty for DIRTY_EXPIRE_MS, or all of them once DIRTY_BACKGROUND
+	are dirty. Writing a block again before it is written back costs no
+	device I/O, and runs of consecutive dirty blocks are written back by a
+	single device write.
+
+	Blocks written back may still sit in the device's own cache.
+	block_flush puts them on stable storage, and the flusher also does
+	every flush_period_ms if it is set. Writers wait for the flusher when DIRTY_LIMIT blocks are
+	dirty, and block_sync writes everything back. Without threads (the
+	kernel build), writers flush the cache themselves at DIRTY_LIMIT.
+
+	A single lock guards the cache, it is not held during device I/O. A
+	block being loaded stays in its entry, marked as loading, and other
+	users of the block wait for it. Writers of the same block are kept in
+	order by the file system locks. A block being written back stays
+	pinned and marked as writing, so it is not written back twice at once.
+*/
+
+#include "common.h"
+#include "util.h"
+#include "block.h"
+#include "lock.h"
+
+#ifdef FAKE
+#include <time.h>
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Waits on a condition for up to ms milliseconds
+static void cond_wait_ms(cond_t *c, mutex_t *m, int ms) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (long) (ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(c, m, &ts);
+}
+#else
+// Without a flusher the age of dirty blocks is not used
+static uint64_t now_ms(void) {
+	return 0;
+}
+#endif
+
+static void lru_remove(blockdev_t *dev, int e) {
+	cache_entry_t *cache = dev->cache;
+
+	if (cache[e].prev != -1)
+		cache[cache[e].prev].next = cache[e].next;
+	else
+		dev->lru_head = cache[e].next;
+	if (cache[e].next != -1)
+		cache[cache[e].next].prev = cache[e].prev;
+	else
+		dev->lru_tail = cache[e].prev;
+}
+
+static void lru_push(blockdev_t *dev, int e) {
+	cache_entry_t *cache = dev->cache;
+
+	cache[e].prev = -1;
+	cache[e].next = dev->lru_head;
+	if (dev->lru_head != -1)
+		cache[dev->lru_head].prev = e;
+	dev->lru_head = e;
+	if (dev->lru_tail == -1)
+		dev->lru_tail = e;
+}
+
+static void hash_remove(blockdev_t *dev, int e) {
+	int *p = &dev->buckets[dev->cache[e].block % CACHE_BUCKETS];
+
+	while (*p != e)
+		p = &dev->cache[*p].hnext;
+	*p = dev->cache[e].hnext;
+}
+
+static int cache_lookup(blockdev_t *dev, int block) {
+	int e;
+
+	for (e = dev->buckets[block % CACHE_BUCKETS]; e != -1; e = dev->cache[e].hnext)
+		if (dev->cache[e].block == block)
+			return e;
+	return -1;
+}
+
+/*	Takes the least recently used entry that is neither pinned nor dirty
+	and assigns it to the given block. Returns -1 if there is none.
+*/
+static int cache_grab(blockdev_t *dev, int block) {
+	cache_entry_t *cache = dev->cache;
+	int e;
+
+	for (e = dev->lru_tail; e != -1 && (cache[e].pins > 0 || cache[e].dirty); e = cache[e].prev);
+	if (e == -1)
+		return -1;
+
+	if (cache[e].block != -1)
+		hash_remove(dev, e);
+	cache[e].block = block;
+	cache[e].pins = 0;
+	cache[e].held = 0;
+	cache[e].loading = 0;
+	cache[e].dirty = 0;
+	cache[e].writing = 0;
+	cache[e].hnext = dev->buckets[block % CACHE_BUCKETS];
+	dev->buckets[block % CACHE_BUCKETS] = e;
+	return e;
+}
+
+/*	Waits until the entry of a block, if any, is not loading. Called with
+	the cache lock held.
+*/
+static int cache_wait(blockdev_t *dev, int block) {
+	int e = cache_lookup(dev, block);
+
+	while (e != -1 && dev->cache[e].loading) {
+		cond_wait(&dev->loaded, &dev->lock);
+		e = cache_lookup(dev, block);
+	}
+	return e;
+}
+
+/*	Returns the entry holding the given block, loading it from the device
+	if needed, and makes it the most recently used. Called with the cache
+	lock held, which is dropped while the block is loaded.
+*/
+static int cache_get(blockdev_t *dev, int block) {
+	cache_entry_t *cache = dev->cache;
+	int e = cache_wait(dev, block);
+
+	if (e == -1) {
+		e = cache_grab(dev, block);
+		if (e == -1)
+			return -1;
+
+		// pinned while loading, so the entry is not taken meanwhile
+		cache[e].loading = 1;
+		cache[e].pins++;
+		mutex_unlock(&dev->lock);
+		dev_read(dev, block, cache[e].data);
+		mutex_lock(&dev->lock);
+		cache[e].loading = 0;
+		cache[e].pins--;
+		cond_broadcast(&dev->loaded);
+	}
+	lru_remove(dev, e);
+	lru_push(dev, e);
+	return e;
+}
+
+/*	Writes dirty blocks back to the device, in block order: all of them if
+	all is set, otherwise the ones dirty for DIRTY_EXPIRE_MS. Blocks are
+	copied out of the cache FLUSH_BATCH at a time and written without the
+	cache lock, which is held by the caller. Blocks already being written
+	back by someone else are left to them.
+*/
+static void flush_dirty(blockdev_t *dev, int all) {
+	cache_entry_t *cache = dev->cache;
+	char buf[FLUSH_BATCH][BLOCK_SIZE];
+	int order[CACHE_BLOCKS], batch[FLUSH_BATCH], blocks[FLUSH_BATCH];
+	int e, i, j, n = 0, nbatch, run;
+	uint64_t now = now_ms();
+
+	// dirty entries, sorted by block
+	for (e = 0; e < CACHE_BLOCKS; e++) {
+		if (!cache[e].dirty || cache[e].writing)
+			continue;
+		if (!all && now - cache[e].dirtied < DIRTY_EXPIRE_MS)
+			continue;
+		for (i = n; i > 0 && cache[order[i - 1]].block > cache[e].block; i--)
+			order[i] = order[i - 1];
+		order[i] = e;
+		n++;
+	}
+
+	for (i = 0; i < n;) {
+		nbatch = 0;
+		for (; i < n && nbatch < FLUSH_BATCH; i++) {
+			e = order[i];
+			// written back meanwhile
+			if (!cache[e].dirty || cache[e].writing)
+				continue;
+			bcopy((unsigned char *) cache[e].data, (unsigned char *) buf[nbatch], BLOCK_SIZE);
+			cache[e].dirty = 0;
+			cache[e].writing = 1;
+			cache[e].pins++;
+			dev->ndirty--;
+			dev->nwriting++;
+			blocks[nbatch] = cache[e].block;
+			batch[nbatch++] = e;
+		}
+
+		// runs of consecutive blocks are a single device write
+		mutex_unlock(&dev->lock);
+		for (j = 0; j < nbatch; j += run) {
+			for (run = 1; j + run < nbatch && blocks[j + run] == blocks[j] + run; run++);
+			dev_write_blocks(dev, blocks[j], run, buf[j]);
+		}
+		mutex_lock(&dev->lock);
+
+		for (j = 0; j < nbatch; j++) {
+			cache[batch[j]].writing = 0;
+			cache[batch[j]].pins--;
+			dev->nwriting--;
+		}
+		dev->unflushed += nbatch;
+		cond_broadcast(&dev->flushed);
+	}
+}
+
+#ifdef FAKE
+/*	Flusher of a device, writes back the expired blocks every
+	FLUSH_INTERVAL_MS, and all of them when woken up by writers.
+*/
+static void *flusher_main(void *arg) {
+	blockdev_t *dev = (blockdev_t *) arg;
+
+	mutex_lock(&dev->lock);
+	while (!dev->stopping) {
+		if (dev->ndirty < DIRTY_BACKGROUND)
+			cond_wait_ms(&dev->flush_wake, &dev->lock, FLUSH_INTERVAL_MS);
+		flush_dirty(dev, dev->ndirty >= DIRTY_BACKGROUND);
+
+		if (dev->flush_period_ms > 0 && dev->unflushed > 0 &&
+		    now_ms() - dev->flushed_at >= (uint64_t) dev->flush_period_ms) {
+			dev->unflushed = 0;
+			dev->flushed_at = now_ms();
+			mutex_unlock(&dev->lock);
+			dev_flush(dev, 0);
+			mutex_lock(&dev->lock);
+		}
+	}
+	mutex_unlock(&dev->lock);
+	return NULL;
+}
+#endif
+
+/*	Opens the device at path, with an empty cache. The flusher flushes the
+	device every flush_period_ms, or never if it is 0. Returns -1 if the
+	device cannot be opened.
+*/
+int block_open(blockdev_t *dev, char *path, int flush_period_ms) {
+	int i;
+
+	if (dev_open(dev, path) < 0)
+		return -1;
+
+	mutex_init(&dev->lock);
+	cond_init(&dev->loaded);
+	cond_init(&dev->flushed);
+	cond_init(&dev->flush_wake);
+	for (i = 0; i < CACHE_BUCKETS; i++)
+		dev->buckets[i] = -1;
+	dev->lru_head = dev->lru_tail = -1;
+	for (i = 0; i < CACHE_BLOCKS; i++) {
+		dev->cache[i].block = -1;
+		dev->cache[i].pins = 0;
+		dev->cache[i].held = 0;
+		dev->cache[i].loading = 0;
+		dev->cache[i].dirty = 0;
+		dev->cache[i].writing = 0;
+		dev->cache[i].hnext = -1;
+		lru_push(dev, i);
+	}
+	dev->ndirty = dev->nwriting = 0;
+	dev->dev_writes = dev->dev_blocks = 0;
+	dev->stopping = 0;
+	dev->flush_period_ms = flush_period_ms;
+	dev->unflushed = 0;
+	dev->flushed_at = now_ms();
+
+#ifdef FAKE
+	thread_create(&dev->flusher, flusher_main, dev);
+#endif
+	return 0;
+}
+
+// Stops the flusher and writes back the blocks still dirty
+void block_close(blockdev_t *dev) {
+#ifdef FAKE
+	mutex_lock(&dev->lock);
+	dev->stopping = 1;
+	cond_broadcast(&dev->flush_wake);
+	mutex_unlock(&dev->lock);
+	thread_join(dev->flusher);
+#endif
+
+	block_flush(dev, 0);
+	dev_close(dev);
+}
+
+/*	Writes back every block dirty when called, and waits until they are
+	on the device.
+*/
+void block_sync(blockdev_t *dev) {
+	mutex_lock(&dev->lock);
+	// blocks dirtied again while being written back are skipped by flushes
+	while (dev->nwriting > 0)
+		cond_wait(&dev->flushed, &dev->lock);
+	flush_dirty(dev, 1);
+	while (dev->nwriting > 0)
+		cond_wait(&dev->flushed, &dev->lock);
+	mutex_unlock(&dev->lock);
+}
+
+/*	Zeroes the whole device and gives it nblocks, without writing them: the
+	cached blocks are zeroed and dropped from the dirty ones, and the
+	device is cut and grown back, so its blocks are holes.
+*/
+void block_zero_all(blockdev_t *dev, int nblocks) {
+	cache_entry_t *cache = dev->cache;
+	int e;
+
+	mutex_lock(&dev->lock);
+	while (dev->nwriting > 0)
+		cond_wait(&dev->flushed, &dev->lock);
+	for (e = 0; e < CACHE_BLOCKS; e++) {
+		while (cache[e].loading)
+			cond_wait(&dev->loaded, &dev->lock);
+		if (cache[e].dirty) {
+			cache[e].dirty = 0;
+			dev->ndirty--;
+		}
+		bzero((char *) cache[e].data, BLOCK_SIZE);
+	}
+
+	dev_truncate(dev, 0);
+	dev_truncate(dev, nblocks);
+	dev->unflushed++;
+	cond_broadcast(&dev->flushed);	// writers waiting for dirty blocks to go
+	mutex_unlock(&dev->lock);
+}
+
+/*	Zeroes the cached copies of count blocks from block on, which are no
+	longer dirty, once they are neither read nor written back. Called
+	with the lock of the cache held.
+*/
+static void drop_blocks(blockdev_t *dev, int block, int count) {
+	cache_entry_t *cache = dev->cache;
+	int e;
+
+	for (e = 0; e < CACHE_BLOCKS; e++) {
+		if (cache[e].block < block || cache[e].block - block >= count)
+			continue;
+		// an older copy being read or written back, look again once done
+		if (cache[e].loading || cache[e].writing) {
+			cond_wait(cache[e].loading ? &dev->loaded : &dev->flushed, &dev->lock);
+			e--;
+			continue;
+		}
+		if (cache[e].dirty) {
+			cache[e].dirty = 0;
+			dev->ndirty--;
+		}
+		bzero((char *) cache[e].data, BLOCK_SIZE);
+	}
+}
+
+/*	Discards count blocks from block on, which hold nothing anymore: their
+	cached copies are zeroed and no longer dirty, and the device drops
+	them. The caller keeps the blocks from being used again meanwhile.
+*/
+void block_discard(blockdev_t *dev, int block, int count) {
+	mutex_lock(&dev->lock);
+	drop_blocks(dev, block, count);
+
+	// dropped with the lock held, so no write back of the blocks starts
+	dev_discard(dev, block, count);
+	dev->unflushed++;
+	cond_broadcast(&dev->flushed);	// writers waiting for dirty blocks to go
+	mutex_unlock(&dev->lock);
+}
+
+/*	Gives the device nblocks. Blocks past the new end are dropped as by
+	block_discard, blocks added read as zeros.
+*/
+void block_truncate(blockdev_t *dev, int nblocks) {
+	mutex_lock(&dev->lock);
+	drop_blocks(dev, nblocks, MAX_BLOCKS - nblocks);
+	dev_truncate(dev, nblocks);
+	dev->unflushed++;
+	cond_broadcast(&dev->flushed);
+	mutex_unlock(&dev->lock);
+}
+
+/*	Writes back every block dirty when called and puts them on stable
+	storage, with the metadata of the device unless data_only is set.
+	Nothing is flushed if no block was written since the last flush.
+*/
+void block_flush(blockdev_t *dev, int data_only) {
+	int unflushed;
+
+	block_sync(dev);
+
+	mutex_lock(&dev->lock);
+	unflushed = dev->unflushed;
+	dev->unflushed = 0;
+	dev->flushed_at = now_ms();
+	mutex_unlock(&dev->lock);
+
+	if (unflushed > 0)
+		dev_flush(dev, data_only);
+}
+
+void block_read(blockdev_t *dev, int block, char *mem) {
+	int e;
+
+	mutex_lock(&dev->lock);
+	e = cache_get(dev, block);
+	if (e == -1) {	// everything is pinned, bypass the cache
+		mutex_unlock(&dev->lock);
+		dev_read(dev, block, mem);
+		return;
+	}
+	bcopy((unsigned char *) dev->cache[e].data, (unsigned char *) mem, BLOCK_SIZE);
+	mutex_unlock(&dev->lock);
+}
+
+void block_write(blockdev_t *dev, int block, char *mem) {
+	int e;
+
+	mutex_lock(&dev->lock);
+	e = cache_wait(dev, block);
+	if (e == -1)
+		e = cache_grab(dev, block);
+	if (e == -1) {	// everything is pinned or dirty, write through
+		dev->unflushed++;
+		mutex_unlock(&dev->lock);
+		dev_write(dev, block, mem);
+		return;
+	}
+
+	bcopy((unsigned char *) mem, (unsigned char *) dev->cache[e].data, BLOCK_SIZE);
+	lru_remove(dev, e);
+	lru_push(dev, e);
+	if (!dev->cache[e].dirty) {
+		dev->cache[e].dirty = 1;
+		dev->cache[e].dirtied = now_ms();
+		dev->ndirty++;
+	}
+
+#ifdef FAKE
+	if (dev->ndirty >= DIRTY_BACKGROUND)
+		cond_broadcast(&dev->flush_wake);
+	// too much dirty data, wait for the flusher
+	while (dev->ndirty >= DIRTY_LIMIT)
+		cond_wait(&dev->flushed, &dev->lock);
+#else
+	if (dev->ndirty >= DIRTY_LIMIT)
+		flush_dirty(dev, 1);
+#endif
+	mutex_unlock(&dev->lock);
+}
+
+/*	Writes a block to the cache and to the device before returning, for a
+	block that must reach the device before blocks written after it.
+*/
+void block_write_through(blockdev_t *dev, int block, char *mem) {
+	int e;
+
+	mutex_lock(&dev->lock);
+	// an older copy being written back must not land after this one
+	while ((e = cache_wait(dev, block)) != -1 && dev->cache[e].writing)
+		cond_wait(&dev->flushed, &dev->lock);
+	if (e != -1) {
+		bcopy((unsigned char *) mem, (unsigned char *) dev->cache[e].data, BLOCK_SIZE);
+		if (dev->cache[e].dirty) {
+			dev->cache[e].dirty = 0;
+			dev->ndirty--;
+		}
+	}
+
+	// written with the lock held, so no flush of the block can start meanwhile
+	dev->unflushed++;
+	dev_write(dev, block, mem);
+	mutex_unlock(&dev->lock);
+}
+
+/*	Puts the blocks already written to the device on stable storage, the
+	dirty blocks of the cache are left there. Used after block_write_through
+	when the block must be stable, not only written, before the next ones.
+*/
+void block_barrier(blockdev_t *dev) {
+	int unflushed;
+
+	mutex_lock(&dev->lock);
+	unflushed = dev->unflushed;
+	dev->unflushed = 0;
+	mutex_unlock(&dev->lock);
+
+	// with the metadata, the writes counted may include a truncate
+	if (unflushed > 0)
+		dev_flush(dev, 0);
+}
+
+/*	Returns the data of a block, kept in place until block_unpin is called.
+	Later writes to the block are seen through it. Returns NULL if every
+	entry of the cache is already pinned.
+*/
+char *block_pin(blockdev_t *dev, int block) {
+	int e;
+
+	mutex_lock(&dev->lock);
+	e = cache_get(dev, block);
+	if (e != -1) {
+		dev->cache[e].pins++;
+		dev->cache[e].held++;
+	}
+	mutex_unlock(&dev->lock);
+
+	return (e == -1) ? NULL : dev->cache[e].data;
+}
+
+void block_unpin(blockdev_t *dev, int block) {
+	int e;
+
+	mutex_lock(&dev->lock);
+	e = cache_lookup(dev, block);
+	if (e != -1 && dev->cache[e].held > 0) {
+		dev->cache[e].pins--;
+		dev->cache[e].held--;
+	}
+	mutex_unlock(&dev->lock);
+}
+
+/*	Returns the number of times a block is pinned by block_pin, the pins
+	taken while loading or writing it back are not counted.
+*/
+int block_pinned(blockdev_t *dev, int block) {
+	int e, held;
+
+	mutex_lock(&dev->lock);
+	e = cache_lookup(dev, block);
+	held = (e == -1) ? 0 : dev->cache[e].held;
+	mutex_unlock(&dev->lock);
+
+	return held;
+}
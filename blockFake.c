@@ -1,47 +1,73 @@
-#include <stdio.h>
+#define _GNU_SOURCE // fallocate
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "common.h"
 #include "block.h"
 
-static FILE *fd;
-
 #include <errno.h>
 
-void block_init(void) {
+/* Devices are image files, read and written at explicit positions so
+   several threads may share them */
+int dev_open(blockdev_t *dev, char *path) {
+	dev->fd = open(path, O_RDWR | O_CREAT, 0644);
+	return (dev->fd == -1) ? -1 : 0;
+}
+
+void dev_close(blockdev_t *dev) {
+	close(dev->fd);
+	dev->fd = -1;
+}
+
+void dev_read(blockdev_t *dev, int block, char *mem) {
 	int ret;
 
-	fd = fopen("./disk", "r+");
-	if (fd == NULL) {
-		fd = fopen("./disk", "w+");
+	ret = pread(dev->fd, mem, BLOCK_SIZE, (off_t) block * BLOCK_SIZE);
+	assert(ret >= 0);
+	if (ret < BLOCK_SIZE) { /* End of file */
+		for (; ret < BLOCK_SIZE; ret++)
+			mem[ret] = 0;
 	}
-	assert(fd);
+}
 
-	ret = fseek(fd, 0, SEEK_SET);
-	assert(ret == 0);
+void dev_write(blockdev_t *dev, int block, char *mem) {
+	dev_write_blocks(dev, block, 1, mem);
+}
+
+/* Writes count consecutive blocks from mem at once */
+void dev_write_blocks(blockdev_t *dev, int block, int count, char *mem) {
+	int ret;
+
+	ret = pwrite(dev->fd, mem, count * BLOCK_SIZE, (off_t) block * BLOCK_SIZE);
+	assert(ret == count * BLOCK_SIZE);
+	atomic_add(&dev->dev_writes, 1);
+	atomic_add(&dev->dev_blocks, count);
 }
 
-void block_read(int block, char *mem) {
+/* Puts the blocks written on stable storage. Without data_only the
+   metadata of the image file is flushed too. */
+void dev_flush(blockdev_t *dev, int data_only) {
 	int ret;
 
-	ret = fseek(fd, block * BLOCK_SIZE, SEEK_SET);
+	ret = data_only ? fdatasync(dev->fd) : fsync(dev->fd);
 	assert(ret == 0);
-    
-	ret = fread(mem, 1, BLOCK_SIZE, fd);
-	if (ret == 0) { /* End of file */
-		ret = BLOCK_SIZE;
-		bzero_block(mem);
-	}
-	assert(ret == BLOCK_SIZE);
 }
 
-void block_write(int block, char *mem) {
+/* Gives the device nblocks. Blocks past the old end are holes of a sparse
+   image file, they read as zeros and take no space. */
+void dev_truncate(blockdev_t *dev, int nblocks) {
 	int ret;
-    
-	ret = fseek(fd, block * BLOCK_SIZE, SEEK_SET);
+
+	ret = ftruncate(dev->fd, (off_t) nblocks * BLOCK_SIZE);
 	assert(ret == 0);
-    
-	ret = fwrite(mem, 1, BLOCK_SIZE, fd);
-	assert(ret == BLOCK_SIZE);
+}
+
+/* Drops count blocks from block on, which then read as zeros and take no
+   space in the image file. Image files on file systems without holes keep
+   the blocks, which is fine since free blocks hold nothing. */
+void dev_discard(blockdev_t *dev, int block, int count) {
+	fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		  (off_t) block * BLOCK_SIZE, (off_t) count * BLOCK_SIZE);
 }
 
 void bzero_block(char *block) {
@@ -50,4 +76,3 @@ void bzero_block(char *block) {
 	for (i = 0; i < BLOCK_SIZE; i++)
 		block[i] = 0;
 }
-
@@ -72,13 +72,16 @@ typedef unsigned long ulong_t;
 #define FS_O_WRONLY 2
 #define FS_O_RDWR 3
 
+// Offsets and sizes of files
+typedef long long int fs_off_t;
+
 typedef struct {
     // Fill in your stat here, this is just an example
     int inodeNo;        /* the file i-node number */
     short type;         /* the file i-node type, DIRECTORY, FILE_TYPE (there's another value FREE_INODE which never appears here */
     char links;         /* number of links to the i-node */
-    int size;           /* file size in bytes */
-    int numBlocks;      /* number of blocks used by the file */
+    fs_off_t size;      /* file size in bytes */
+    int numBlocks;      /* number of blocks allocated to the file, holes of sparse files are not counted */
 } fileStat;
 
 struct directory_t {
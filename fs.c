@@ -3,6 +3,7 @@
 #include "block.h"
 #include "fs.h"
 #include "fsUtil.h"
+#include "lock.h"
 #include <assert.h>
 
 #ifdef FAKE
@@ -10,75 +11,242 @@
 #include <stdlib.h>
 #endif
 
-superblock_t super;
-bmap_t map;
-dir_t current_dir;
+char zero_block[BLOCK_SIZE]; // memory of the holes of mapped ranges
 
-char current_path[MAX_PATH_NAME];
+// File systems mounted by fs_mount and their sessions
+static mount_t mounts[MAX_MOUNTS];
+static fs_t sessions[MAX_SESSIONS];
+static mutex_t mounts_lock = MUTEX_INITIALIZER; // guards both tables
 
-FileDescriptor table[MAX_OPEN_FILES];
+// Releases the entry of a mount and the ones of all its sessions
+static void release_mount(mount_t *fs){
+    mutex_lock(&mounts_lock);
+    for(int i = 0; i < MAX_SESSIONS; i++){
+        if(sessions[i].mount == fs)
+            sessions[i].mount = NULL;
+    }
+    fs->mounted = FALSE;
+    mutex_unlock(&mounts_lock);
+}
+
+// Takes a free entry of the sessions table, for a session working on the
+// directory cwd. Called with mounts_lock held.
+static fs_t *new_session(mount_t *fs, int cwd){
+    for(int i = 0; i < MAX_SESSIONS; i++){
+        if(sessions[i].mount == NULL){
+            sessions[i].mount = fs;
+            sessions[i].cwd = cwd;
+            return &sessions[i];
+        }
+    }
+    return NULL;
+}
 
-void fs_init(void){
-    block_init();
+// Returns TRUE if a superblock read from an image lays it out as
+// set_geometry would, so its tables can be trusted
+static bool_t is_geometry_ok(superblock_t *sb){
+    superblock_t expected = *sb;
+
+    if(sb->block_size != BLOCK_SIZE || sb->inodes_per_block != INODES_PER_BLOCK ||
+       sb->num_inodes % INODES_PER_BLOCK != 0 || sb->size_disk > MAX_BLOCKS ||
+       set_geometry(&expected, sb->size_disk, sb->num_inodes) < 0)
+        return FALSE;
+    return expected.num_data_blocks == sb->num_data_blocks && expected.beg_data == sb->beg_data &&
+           expected.beg_dmap == sb->beg_dmap && expected.beg_refcount == sb->beg_refcount &&
+           expected.dirty_itable_span == sb->dirty_itable_span && sb->num_orphans <= MAX_ORPHANS;
+}
+
+/*
+    Mounts the file system held by the image at path. With FS_MOUNT_FORMAT
+    an image without a file system is formatted, otherwise it is refused,
+    and so is an image whose superblock does not add up.
+    The options also pick a durability mode, FS_MOUNT_DURABLE_*.
+    Returns the first session on the file system, working on its root, or
+    NULL if it cannot be mounted.
+*/
+fs_t *fs_mount(char *path, int options){
+    mount_t *fs = NULL;
+    fs_t *session = NULL;
+
+    // take a free entry of the mounts table
+    mutex_lock(&mounts_lock);
+    for(int i = 0; i < MAX_MOUNTS; i++){
+        if(mounts[i].mounted == FALSE){
+            fs = &mounts[i];
+            session = new_session(fs, 0);
+            if(session != NULL)
+                fs->mounted = TRUE;
+            break;
+        }
+    }
+    mutex_unlock(&mounts_lock);
+    if(session == NULL){
+        return NULL;
+    }
+
+    fs->durability = options & FS_MOUNT_DURABLE_MASK;
+    fs->discard = (options & FS_MOUNT_DISCARD) != 0;
+    if(block_open(&fs->dev, path, (fs->durability == FS_MOUNT_DURABLE_PERIODIC) ? DURABLE_PERIOD_MS : 0) < 0){
+        release_mount(fs);
+        return NULL;
+    }
+    init_locks(fs);
+    fs->map_batch = 0;
+    fs->map_deferred = 0;
+    init_async(fs);
+    dcache_forget(fs, -1);
     
     Block block;
-    block_read(0, (char *) &block); 
+    block_read(&fs->dev, 0, (char *) &block); 
 
     // check if disk is formatted
-    if(block.sb.magic_number == MAGIC_NUMBER){
-        super = block.sb; // set superblock
+    if(block.sb.magic_number == MAGIC_NUMBER && is_geometry_ok(&block.sb)){
+        fs->super = block.sb; // set superblock
 
         // load map
-        block_read(super.beg_map, (char *) &block);
-        map = block.map; // set bits map
+        if(alloc_tables(fs, TRUE) < 0){
+            block_close(&fs->dev);
+            release_mount(fs);
+            return NULL;
+        }
+        fs->free_list.nruns = 0;
 
-        block_read(super.beg_data, (char *) &block);
-        current_dir = block.data_block.dir; // set root
+        fs->shared_blocks = count_shared_blocks(fs);
         
-        // initialize open-files table
-        for(int i = 0; i < MAX_OPEN_FILES; i++){
-            table[i].fd = -1;
-            bzero(table[i].name, MAX_PATH_NAME);
+        init_fd_table(fs); // no file open
+
+        // after a crash, check the inodes changed since the last checkpoint,
+        // and repair the whole file system if they are wrong
+        fsCheck check;
+        fs_fsck(session, &check, FS_FSCK_DIRTY | FS_FSCK_REPAIR);
+
+        // free the files left on the orphan list by a crash
+        fs_reclaim(session, -1);
+    }else if(block.sb.magic_number != MAGIC_NUMBER && (options & FS_MOUNT_FORMAT)){
+        // format disk
+        if(fs_mkfs(session) < 0){
+            block_close(&fs->dev);
+            release_mount(fs);
+            return NULL;
         }
     }else{
-        fs_mkfs(); // format disk
+        // printf("mount: Image holds no file system.\n");
+        block_close(&fs->dev);
+        release_mount(fs);
+        return NULL;
     }
+
+    return session;
+}
+
+/*
+    Unmounts a file system, given any of its sessions, and closes all of
+    them. Its asynchronous operations are run to the end, buffered data is
+    written back and its descriptors are closed.
+*/
+int fs_umount(fs_t *session){
+    mount_t *fs = session->mount;
+    stop_async(fs);
+
+    for(int fd = 0; fd < fs->fd_nchunks * FD_CHUNK; fd++){
+        if(get_fd(fs, fd) != NULL)
+            fs_close(session, fd);
+    }
+    release_fd_table(fs);
+
+    lock_all_inodes(fs);
+    checkpoint(fs); // clears the blocks left on the free list too
+    unlock_all_inodes(fs);
+
+    block_close(&fs->dev);
+    release_tables(fs);
+    release_mount(fs);
+
+    return 0;
 }
 
-int fs_mkfs(void){
+// Opens another session on the file system of a session, working on the
+// same directory. Returns NULL if there are too many sessions.
+fs_t *fs_session_open(fs_t *session){
+    fs_t *new;
 
-    char null_block[BLOCK_SIZE];
-    bzero(null_block, BLOCK_SIZE);
-    for(int i = 0; i < FS_SIZE; i++){
-        block_write(i, null_block);
+    mutex_lock(&mounts_lock);
+    new = new_session(session->mount, session->cwd);
+    mutex_unlock(&mounts_lock);
+
+    return new;
+}
+
+// Closes a session, its file system stays mounted even if it was the last
+// one
+int fs_session_close(fs_t *session){
+    mutex_lock(&mounts_lock);
+    session->mount = NULL;
+    mutex_unlock(&mounts_lock);
+
+    return 0;
+}
+
+// Returns TRUE if the directory inum is the working directory of a session
+static bool_t is_session_cwd(mount_t *fs, int inum){
+    bool_t found = FALSE;
+
+    mutex_lock(&mounts_lock);
+    for(int i = 0; i < MAX_SESSIONS; i++){
+        if(sessions[i].mount == fs && sessions[i].cwd == inum)
+            found = TRUE;
     }
+    mutex_unlock(&mounts_lock);
+
+    return found;
+}
+
+// Formats the file system of a session, with FS_SIZE blocks and an inode
+// for every FS_BYTES_PER_INODE bytes
+int fs_mkfs(fs_t *session){
+    return fs_mkfs_geometry(session, (fs_off_t) FS_SIZE * BLOCK_SIZE, FS_BYTES_PER_INODE);
+}
+
+/*
+    Formats the file system of a session, giving the image size bytes and
+    an inode for every bytes_per_inode of them. Nothing but the few blocks
+    of an empty file system is written: the image is emptied and given its
+    blocks, all of them holes reading as zeros, which is what free inodes,
+    an empty reference counts table and a clear map hold. So formatting
+    takes the same time whatever the size of the image. Returns -1 if the
+    geometry does not fit, or if there is no memory for its tables.
+*/
+int fs_mkfs_geometry(fs_t *session, fs_off_t size, int bytes_per_inode){
+    mount_t *fs = session->mount;
+    superblock_t sb;
+    fs_off_t nblocks = size / BLOCK_SIZE, num_inodes;
+
+    if(nblocks <= 0 || nblocks > MAX_BLOCKS || bytes_per_inode < (int) sizeof(inode_t))
+        return -1;
 
     // define superblock
-    super = (superblock_t) {.magic_number = MAGIC_NUMBER,
-                            .size_disk = FS_SIZE,
-                            .block_size = BLOCK_SIZE,
-                            .num_inodes = INODES_PER_BLOCK * INODES_BLOCKS,
-                            .num_data_blocks = FS_SIZE - 2 - INODES_BLOCKS,
-                            .num_blocks_inodes = INODES_BLOCKS,
-                            .beg_inodes = 1, 
-                            .beg_map = 1 + INODES_BLOCKS, 
-                            .beg_data = 2 + INODES_BLOCKS,
-                            .pointers_per_block = BLOCK_SIZE/4,
-                            .pointers_per_dcb = POINTERS_PER_DCB,
-                            .inodes_per_block = INODES_PER_BLOCK,
-                            .direct_pointers = DIRECT_POINTERS
-                           };
-
-    // mark inodes and block data as free
-    for(int i = 0; i < IMAP_BYTES; i++) map.imap[i] = 0;
-    for(int i = 0; i < DMAP_BYTES; i++) map.dmap[i] = 0;
-
-    // create root dir
-    for(int i = 0; i < super.pointers_per_dcb; i++)
-        current_dir.files_inum[i] = -1;
-    bcopy((uint8_t *)  ".",(uint8_t *) current_dir.files_name[0], 2);
-    bcopy((uint8_t *) "..",(uint8_t *) current_dir.files_name[1], 3);
-    current_dir.files_inum[0] = current_dir.files_inum[1] = 0;
+    num_inodes = (size / bytes_per_inode + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK * INODES_PER_BLOCK;
+    if(num_inodes >= nblocks * INODES_PER_BLOCK || num_inodes > MAX_BLOCKS) return -1;
+    sb = (superblock_t) {.magic_number = MAGIC_NUMBER,
+                         .block_size = BLOCK_SIZE,
+                         .pointers_per_block = BLOCK_SIZE/4,
+                         .pointers_per_dcb = POINTERS_PER_DCB,
+                         .inodes_per_block = INODES_PER_BLOCK,
+                         .direct_pointers = DIRECT_POINTERS
+                        };
+    if(set_geometry(&sb, nblocks, num_inodes) < 0) return -1;
+
+    release_tables(fs);
+    fs->super = sb;
+    if(alloc_tables(fs, FALSE) < 0) return -1;
+    block_zero_all(&fs->dev, nblocks);
+
+    // inodes and data blocks are free, the map is clear
+    fs->free_list.nruns = 0;
+    fs->shared_blocks = 0; // the reference counts table reads as zeros
+
+    // create root dir, its parent is itself
+    dir_t root = create_directory(fs, 0, 0);
 
     // create inode to root dir
     inode_t iroot = (inode_t) {.type = DIRECTORY,
@@ -87,63 +255,74 @@ int fs_mkfs(void){
                                .indirect1 = -1,
                                .indirect2 = -1,
                                .indirect3 = -1};
-    for(int i = 0; i < super.direct_pointers; i++)
+    for(int i = 0; i < fs->super.direct_pointers; i++)
             iroot.direct[i] = -1;
     iroot.direct[0] = 0;
     
     // set inum and iblock of root as used
-    map.imap[0] |= (1<<7);
-    map.dmap[0] |= (1<<7);
+    set_imap_bit(fs, 0, TRUE);
+    set_dmap_bit(fs, 0, TRUE);
 
     // writing to disk
     Block block;
-    block.sb = super;
-    block_write(0, (char *) &block); // writing superblock
+    bzero((char *) &block, BLOCK_SIZE);
+    block.sb = fs->super;
+    block_write(&fs->dev, 0, (char *) &block); // writing superblock
 
+    bzero((char *) &block, BLOCK_SIZE);
     block.inodes[0] = iroot;
-    block_write(1, (char *) &block); // writing first inode
+    block_write(&fs->dev, fs->super.beg_inodes, (char *) &block); // writing first inode
 
-    save_map(); // writing bits map
+    save_map(fs); // writing bits map
 
-    block.data_block.dir = current_dir;
-    block_write(super.beg_data, (char *) &block); // writing root directory
+    block.data_block.dir = root;
+    block_write(&fs->dev, fs->super.beg_data, (char *) &block); // writing root directory
 
-    // initialize open-files table
-    for(int i = 0; i < MAX_OPEN_FILES; i++){
-        table[i].fd = -1;
-        bzero(table[i].name, MAX_PATH_NAME);
-    }
+    init_fd_table(fs); // no file open
 
-    // initialize current path
-    bcopy((uint8_t*) "/", (uint8_t*) current_path, 2);
+    // every session is back at the root
+    mutex_lock(&mounts_lock);
+    for(int i = 0; i < MAX_SESSIONS; i++){
+        if(sessions[i].mount == fs)
+            sessions[i].cwd = 0;
+    }
+    mutex_unlock(&mounts_lock);
+    dcache_forget(fs, -1);
+    commit_op(fs);
 
     return 0;
 }
 
-int fs_open(char *fileName, int flags){
+int fs_open(fs_t *session, char *fileName, int flags){
+    mount_t *fs = session->mount;
 
-    Block block;
-    int ret;
-    inode_t inode_dir = get_inode_per_inum(current_dir.files_inum[0]);
-    int existFile = find_file_in_dir(inode_dir, fileName, NULL);
-
-    int fd = get_single_available_fd();
-    if(fd < 0){
+    int ret, fd;
+    char name[MAX_FILE_NAME];
+    int dir_inum = walk_path(fs, session->cwd, fileName, name);
+    if(dir_inum < 0){
+        // printf("open: Path does not exist.\n");
         return -1;
     }
 
+    // the directory only changes if the file is created
+    lock_inode(fs, dir_inum, flags == FS_O_RDONLY ? LOCK_READ : LOCK_WRITE);
+    inode_t inode_dir = get_inode_per_inum(fs, dir_inum);
+    int existFile = find_file_in_dir(fs, inode_dir, name, NULL);
+
     // if file doesn't exist and flags is RDWR or WRONLY, we must create
     // the file
     if(existFile == -1) {
         if(flags == FS_O_RDONLY){
             // printf("open: File does not exist.");
-           return -1;
+            unlock_inode(fs, dir_inum);
+            return -1;
         }
 
         // Allocate inode
-        int inum = get_single_available_inode();
+        int inum = get_single_available_inode(fs);
         if(inum < 0){
             //printf("open: There is no inode available.\n");
+            unlock_inode(fs, dir_inum);
             return -1;
         }
 
@@ -154,304 +333,735 @@ int fs_open(char *fileName, int flags){
                                        .indirect1 = -1,
                                        .indirect2 = -1,
                                        .indirect3 = -1};
-        for(int i = 0; i < super.direct_pointers; i++)
+        for(int i = 0; i < fs->super.direct_pointers; i++)
             new_ifile.direct[i] = -1;
 
         // update parent        
-        ret = insert_file_in_dir(&inode_dir, fileName, inum);
+        ret = insert_file_in_dir(fs, &inode_dir, name, inum);
         if(ret < 0){
-            free_inode(inum);
+            free_inode(fs, inum);
+            unlock_inode(fs, dir_inum);
             return -1;
         }
         inode_dir.size++;
 
-        block_read(super.beg_data + inode_dir.direct[0], (char *) &block);
-        current_dir = block.data_block.dir;
-
         // write blocks to disk
-        save_inode(inum, new_ifile); // writing new inode
-        save_inode(current_dir.files_inum[0], inode_dir); // writing new inode
-
-        block.map = map;
-        block_write(super.beg_map, (char *) &block); // writing bits map
+        save_inode(fs, inum, new_ifile); // writing new inode
+        save_inode(fs, dir_inum, inode_dir); // writing new inode
+        save_map(fs); // writing bits map
     
         existFile = inum;
     }
 
-
-    inode_t current_inode = get_inode_per_inum(existFile);
+    inode_t current_inode = get_inode_per_inum(fs, existFile);
 
     if(current_inode.type == DIRECTORY && flags != FS_O_RDONLY){
+        unlock_inode(fs, dir_inum);
         return -1;
     }
 
     // create a new FileDescriptor instance
-    FileDescriptor file;
-    file.fd = fd; 
-    bcopy((uint8_t*) fileName, (uint8_t*)file.name, strlen(fileName)+1);
+    FileDescriptor file = {0};
     file.inode = existFile;
     file.flag = flags;
     file.rw_ptr = 0;
+    file.wbuf = -1;
+    file.wbuf_error = FALSE;
 
-    // insert into the table
-    table[fd] = file;
+    // insert into the table, before the directory is unlocked so the file
+    // cannot be unlinked and freed in between
+    fd = get_single_available_fd(fs, &file);
+    unlock_inode(fs, dir_inum);
+    commit_op(fs);
 
     return fd;
 }
 
-int fs_close(int fd){
+int fs_close(fs_t *session, int fd){
+    mount_t *fs = session->mount;
     
-    if(fd >= MAX_OPEN_FILES || table[fd].fd == -1){
+    FileDescriptor *file = get_fd(fs, fd);
+    if(file == NULL){
         return -1;
     }
 
-    inode_t current_inode = get_inode_per_inum(table[fd].inode);
+    int inum = file->inode;
+    lock_inode(fs, inum, LOCK_WRITE);
 
-    // Erase file whether it's its last link
-    if (current_inode.link_counter == 0){
+    // write back buffered data
+    int ret = flush_fd(fs, fd);
 
-        // check if there isn't any other fd open for this inode
-        int found = 0;
-        for(found = 0; found < MAX_OPEN_FILES; found++){
-            if(found != fd &&table[found].fd != -1 && 
-                 table[found].inode == table[fd].inode){
-                break;
-            }
-        }
+    inode_t current_inode = get_inode_per_inum(fs, inum);
 
-        if(found == MAX_OPEN_FILES){
-            // free all data blocks associate with this file
-            free_all_data_blocks(current_inode);
-            // free its inode
-            free_inode(table[fd].inode);
-            // save changes
-            save_map();
-        }
+    // close its fd, and erase file whether it's its last link and there
+    // isn't any other fd open or range mapped for it. Orphans are left to
+    // fs_reclaim, and a mapped file to fs_unmap_range.
+    if(release_fd(fs, fd) == TRUE && current_inode.link_counter == 0 && 
+       !is_inode_mapped(fs, inum) && find_orphan(fs, inum) < 0){
+        // free all data blocks associate with this file
+        free_all_data_blocks(fs, current_inode);
+        // free its inode
+        free_inode(fs, inum);
+        // save changes
+        save_map(fs);
     }
 
-    // close its fd
-    table[fd].fd = -1;
+    unlock_inode(fs, inum);
+    commit_op(fs);
 
-    return 0;
+    return ret;
 }
 
-int fs_read(int fd, char *buf, int count){
-    int rw, index_block, iblock;
-    inode_t current_inode;
-    DataBlock block;
+int fs_read(fs_t *session, int fd, char *buf, int count){
+    iovec_t iov = {.base = buf, .len = count};
+    return fs_readv(session, fd, &iov, 1);
+}
 
-    if(count == 0){
-        return 0;
+int fs_readv(fs_t *session, int fd, iovec_t *iov, int iovcnt){
+    mount_t *fs = session->mount;
+    int ret;
+
+    FileDescriptor *file = get_fd(fs, fd);
+    if(file == NULL || iovcnt < 0){
+        return -1;
+    }
+
+    // directories are only opened as read only, so checking the flag is
+    // enough to know if the descriptor can be read
+    if(file->flag == FS_O_WRONLY){
+        // printf("read: Target cannot be a directory.\n");
+        return -1;
+    }
+
+    // the total is checked before anything is read
+    if(iov_length(iov, iovcnt) < 0){
+        return -1;
     }
 
-    if(fd >= MAX_OPEN_FILES || table[fd].fd == -1){
+    // see data still buffered by any descriptor of this file
+    sync_inode_fds(fs, file->inode);
+
+    lock_inode(fs, file->inode, LOCK_READ);
+    ret = read_file_iov(fs, file->inode, file->rw_ptr, iov, iovcnt);
+    unlock_inode(fs, file->inode);
+
+    if(ret > 0){
+        file->rw_ptr += ret;
+    }
+    return ret;
+}
+
+int fs_pread(fs_t *session, int fd, char *buf, int count, int offset){
+    return fs_pread64(session, fd, buf, count, offset);
+}
+
+int fs_pread64(fs_t *session, int fd, char *buf, int count, fs_off_t offset){
+    mount_t *fs = session->mount;
+    iovec_t iov = {.base = buf, .len = count};
+    int ret;
+
+    FileDescriptor *file = get_fd(fs, fd);
+    if(file == NULL || offset < 0){
+        return -1;
+    }
+
+    if(file->flag == FS_O_WRONLY){
         return -1;
     }
 
-    for(int i = 0; i < count; i++) buf[i] = '\0';
+    sync_inode_fds(fs, file->inode);
+
+    lock_inode(fs, file->inode, LOCK_READ);
+    ret = read_file_iov(fs, file->inode, offset, &iov, 1);
+    unlock_inode(fs, file->inode);
 
-    current_inode = get_inode_per_inum(table[fd].inode);
+    return ret;
+}
     
-    // check if current inode is a file
-    if((current_inode.type == DIRECTORY && table[fd].flag != FS_O_RDONLY) 
-          || table[fd].flag == FS_O_WRONLY){
-        // printf("read: Target cannot be a directory.\n");
+int fs_write(fs_t *session, int fd, char *buf, int count){
+    iovec_t iov = {.base = buf, .len = count};
+    return fs_writev(session, fd, &iov, 1);
+}
+
+int fs_writev(fs_t *session, int fd, iovec_t *iov, int iovcnt){
+    mount_t *fs = session->mount;
+    int ret, count = 0;
+
+    FileDescriptor *file = get_fd(fs, fd);
+    if(file == NULL || iovcnt < 0){
         return -1;
     }
 
-    // get current pointer position
-    index_block = table[fd].rw_ptr / super.block_size;
-    rw = table[fd].rw_ptr % super.block_size;
+    // directories are never opened for writing, so there is no need to
+    // load the inode to check its type
+    if(file->flag == FS_O_RDONLY){
+        // printf("read: Target cannot be a directory.\n");
+        return -1;
+    }
 
-    int num_blocks = (current_inode.size + super.block_size-1) / super.block_size;
-    if(index_block >= num_blocks){
-        return 0;
+    // the total is checked before anything is written
+    count = iov_length(iov, iovcnt);
+    if(count <= 0){
+        return count;
     }
 
-    iblock = get_iblock(current_inode, index_block);
+    lock_inode(fs, file->inode, LOCK_WRITE);
 
-    block_read(super.beg_data + iblock, (char *) &block);
-    for(int i = 0; i < count; i++, rw++){
+    // the file can't grow past its block tree, nothing is written then
+    if(file->rw_ptr + count > max_file_size(fs)){
+        unlock_inode(fs, file->inode);
+        return -1;
+    }
 
-        // if we already look throughout a block, we must load the next one
-        if(rw == super.block_size){
-            rw = 0;
-            iblock = get_iblock(current_inode, ++index_block);
-            if(iblock == -1){
-                table[fd].rw_ptr += i;
-                return i;
+    // keep writes ordered with data buffered by other descriptors
+    flush_inode_fds(fs, file->inode, fd);
+
+    if(count < fs->super.block_size && fs->durability != FS_MOUNT_DURABLE_OP){
+        // small writes are coalesced in the write-behind buffer
+        ret = 0;
+        for(int i = 0; i < iovcnt && ret >= 0; i++){
+            if(iov[i].len == 0) continue;
+            ret = buffer_write(fs, fd, iov[i].base, iov[i].len);
+            if(ret > 0){
+                file->rw_ptr += ret;
             }
-            block_read(super.beg_data + iblock, (char *) &block);  
         }
+        unlock_inode(fs, file->inode);
+        return (ret < 0) ? -1 : count;
+    }
 
-        // check if we got the maximum size of the file 
-        if(current_inode.size <= table[fd].rw_ptr+i){
-            table[fd].rw_ptr += i;
-            return i;
-        }
+    if(flush_fd(fs, fd) < 0){
+        unlock_inode(fs, file->inode);
+        return -1;
+    }
+    ret = write_file_iov(fs, file->inode, file->rw_ptr, iov, iovcnt);
+    if(ret > 0){
+        file->rw_ptr += ret;
+    }
+    unlock_inode(fs, file->inode);
+    commit_op(fs);
+    return ret;
+}
+
+int fs_pwrite(fs_t *session, int fd, char *buf, int count, int offset){
+    return fs_pwrite64(session, fd, buf, count, offset);
+}
+
+int fs_pwrite64(fs_t *session, int fd, char *buf, int count, fs_off_t offset){
+    mount_t *fs = session->mount;
+    int ret;
 
-        // save data to buf
-        buf[i] = block.data[rw];
+    FileDescriptor *file = get_fd(fs, fd);
+    if(file == NULL || offset < 0 || count < 0 || offset + count > max_file_size(fs)){
+        return -1;
+    }
+
+    if(file->flag == FS_O_RDONLY){
+        return -1;
     }
 
-    table[fd].rw_ptr += count;
-    return count;
+    lock_inode(fs, file->inode, LOCK_WRITE);
+
+    // buffered data of any descriptor may overlap this write
+    flush_inode_fds(fs, file->inode, -1);
+
+    ret = write_file(fs, file->inode, offset, buf, count);
+    unlock_inode(fs, file->inode);
+    commit_op(fs);
+
+    return ret;
 }
-    
-int fs_write(int fd, char *buf, int count){
-    int rw, index_block, iblock, need;
-    inode_t current_inode;
-    DataBlock block;
 
-    if(count == 0){
-        return 0;
+int fs_copy_range(fs_t *session, int fd_in, fs_off_t off_in, int fd_out, fs_off_t off_out, int len){
+    mount_t *fs = session->mount;
+    fs_off_t pos;
+    int rw, n, done, nblocks, ret;
+    int iblocks[BLOCK_RUN];
+    iovec_t iov[BLOCK_RUN];
+    DataBlock stage[BLOCK_RUN];
+    inode_t src_inode;
+
+    FileDescriptor *in = get_fd(fs, fd_in), *out = get_fd(fs, fd_out);
+    if(in == NULL || out == NULL ||
+       off_in < 0 || off_out < 0 || len < 0){
+        return -1;
     }
 
-    if(fd >= MAX_OPEN_FILES || table[fd].fd == -1){
+    if(in->flag == FS_O_WRONLY || out->flag == FS_O_RDONLY){
         return -1;
     }
 
-    current_inode = get_inode_per_inum(table[fd].inode);
-    
-    // check if file is a directory and R/W pointer is valid
-    if(current_inode.type == DIRECTORY || table[fd].flag == FS_O_RDONLY){
-        // printf("read: Target cannot be a directory.\n");
+    // copying a range over itself is not supported
+    if(in->inode == out->inode && 
+       off_in < off_out + len && off_out < off_in + len){
         return -1;
     }
 
-    need = table[fd].rw_ptr - current_inode.size;
-    
-    if(need > 0){
-        index_block = current_inode.size / super.block_size;
-        rw = current_inode.size % super.block_size;
-    }else{
-        need = 0;
-        index_block = table[fd].rw_ptr / super.block_size;
-        rw = table[fd].rw_ptr % super.block_size;
+    lock_inodes(fs, in->inode, LOCK_WRITE, out->inode, LOCK_WRITE);
+
+    // see data still buffered by any descriptor of both files
+    flush_inode_fds(fs, in->inode, -1);
+    flush_inode_fds(fs, out->inode, -1);
+
+    src_inode = get_inode_per_inum(fs, in->inode);
+
+    // never copy past the end of the source
+    if(off_in >= src_inode.size){
+        unlock_inodes(fs, in->inode, out->inode);
+        return 0;
+    }
+    if(len > src_inode.size - off_in){
+        len = src_inode.size - off_in;
     }
 
-    iblock = get_iblock(current_inode, index_block);
-    if(iblock == -1){
-        if (index_block >= max_blocks_of_file() || blocks_used() == super.num_data_blocks){
-            // printf("write: File has maximum size.\n");
-            return -1;
+    done = 0;
+    while(done < len){
+        // resolve a run of source blocks at once
+        pos = off_in + done;
+        rw = pos % fs->super.block_size;
+        nblocks = (rw + len - done + fs->super.block_size - 1) / fs->super.block_size;
+        if(nblocks > BLOCK_RUN){
+            nblocks = BLOCK_RUN;
         }
-        // try to allocate block
-        iblock = get_single_available_iblock();
-        if(iblock < 0){
-            // printf("write: Couldn't write string to file.\n");
-            return -1;
+        src_inode = get_inode_per_inum(fs, in->inode);
+        get_iblock_run(fs, src_inode, pos / fs->super.block_size, nblocks, iblocks);
+
+        // load the source blocks, holes come from the zero block
+        n = 0;
+        for(int i = 0; i < nblocks; i++, rw = 0){
+            iov[i].len = fs->super.block_size - rw;
+            if(iov[i].len > len - done - n){
+                iov[i].len = len - done - n;
+            }
+
+            if(iblocks[i] == -1){
+                iov[i].base = zero_block + rw;
+            }else{
+                block_read(&fs->dev, fs->super.beg_data + iblocks[i], (char *) &stage[i]);
+                iov[i].base = (char *) stage[i].data + rw;
+            }
+            n += iov[i].len;
         }
 
-        if(set_iblock(&current_inode, index_block, iblock) < 0){
-            free_iblock(iblock);
-            return -1;
+        // write them in a single pass over the destination block map, whole
+        // blocks are written as they are and partial ones merged in place
+        ret = write_file_iov(fs, out->inode, off_out + done, iov, nblocks);
+        if(ret <= 0){
+            break;
         }
-        
-        bzero((char *) &block, super.block_size);
-        block_write(super.beg_data + iblock, (char *) &block);
-    }
-
-    block_read(super.beg_data + iblock, (char *) &block);
-    for(int i = 0; i < count+need; i++, rw++){
-        if(rw == super.block_size){
-            // save block already written
-            block_write(super.beg_data + iblock, (char *) &block);
-
-            rw = 0;
-            iblock = get_iblock(current_inode, ++index_block);
-            if(iblock == -1){
-                // allocate if I can
-                if (index_block >= max_blocks_of_file()){
-                    // printf("write: File has maximum size.\n");
-                    return -1;
-                }
-                iblock = get_single_available_iblock();
-                if(iblock < 0){
-                    table[fd].rw_ptr += i;
-                    if(table[fd].rw_ptr > current_inode.size){
-                        current_inode.size = table[fd].rw_ptr;
-                    }
-                    save_inode(table[fd].inode, current_inode); // save inode
-                    save_map();
-                    return i;
-                }
-
-                if(set_iblock(&current_inode, index_block, iblock) < 0){
-                    table[fd].rw_ptr += i;
-                    if(table[fd].rw_ptr > current_inode.size){
-                        current_inode.size = table[fd].rw_ptr;
-                    }
-                    save_inode(table[fd].inode, current_inode); // save inode
-                    free_inode(iblock);
-                    save_map();
-                    return i;
-                }
+        done += ret;
+        if(ret < n){
+            break;
+        }
+    }
+    unlock_inodes(fs, in->inode, out->inode);
+    commit_op(fs);
 
-            }
-            block_read(super.beg_data + iblock, (char *) &block);
+    return (done == 0 && len > 0) ? -1 : done;
+}
+
+int fs_map_range(fs_t *session, int fd, fs_off_t offset, int len, fsMapping *mapping){
+    mount_t *fs = session->mount;
+    int rw, n, done, nblocks, index_block;
+    int iblocks[MAX_MAP_SPANS];
+    inode_t current_inode;
+    char *data;
+
+    mapping->nspans = 0;
+
+    FileDescriptor *file = get_fd(fs, fd);
+    if(file == NULL || offset < 0 || len < 0){
+        return -1;
+    }
+
+    if(file->flag == FS_O_WRONLY){
+        return -1;
+    }
+
+    // see data still buffered by any descriptor of this file
+    sync_inode_fds(fs, file->inode);
+
+    // the lock is held until the range is counted as mapped, so its blocks
+    // can't be freed and reused by another file before
+    lock_inode(fs, file->inode, LOCK_READ);
+    current_inode = get_inode_per_inum(fs, file->inode);
+
+    // never map past the end of the file
+    if(offset >= current_inode.size || len == 0){
+        unlock_inode(fs, file->inode);
+        return 0;
+    }
+    if(len > current_inode.size - offset){
+        len = current_inode.size - offset;
+    }
+
+    index_block = offset / fs->super.block_size;
+    rw = offset % fs->super.block_size;
+    nblocks = (rw + len + fs->super.block_size - 1) / fs->super.block_size;
+    if(nblocks > MAX_MAP_SPANS){
+        nblocks = MAX_MAP_SPANS;
+    }
+    get_iblock_run(fs, current_inode, index_block, nblocks, iblocks);
+
+    // pin every block of the range, each one is a span
+    done = 0;
+    for(int i = 0; i < nblocks; i++, rw = 0){
+        n = fs->super.block_size - rw;
+        if(n > len - done){
+            n = len - done;
         }
 
-        if(i < need){
-            block.data[rw] = 0;
+        if(iblocks[i] == -1){
+            // hole of a sparse file
+            data = zero_block;
         }else{
-            block.data[rw] = buf[i-need];
+            data = block_pin(&fs->dev, fs->super.beg_data + iblocks[i]);
+            if(data == NULL){
+                // no more room to pin blocks
+                break;
+            }
+
+            // the range holds a reference to the block, as a clone would,
+            // so the block outlives the file writing or freeing it
+            if(ref_iblock(fs, iblocks[i]) < 0){
+                block_unpin(&fs->dev, fs->super.beg_data + iblocks[i]);
+                break;
+            }
+        }
+
+        mapping->spans[i] = (iovec_t) {.base = data + rw, .len = n};
+        mapping->blocks[i] = iblocks[i];
+        mapping->nspans++;
+        done += n;
+    }
+
+    if(mapping->nspans == 0){
+        unlock_inode(fs, file->inode);
+        return -1;
+    }
+    mapping->inode = file->inode;
+    atomic_add(&fs->map_counts[file->inode], 1);
+    unlock_inode(fs, file->inode);
+    return done;
+}
+
+int fs_unmap_range(fs_t *session, fsMapping *mapping){
+    mount_t *fs = session->mount;
+    int inum = mapping->inode;
+    inode_t current_inode;
+
+    if(mapping->nspans == 0){
+        return 0;
+    }
+
+    // drop the references of the range, the blocks only it still held
+    // are freed
+    for(int i = 0; i < mapping->nspans; i++){
+        if(mapping->blocks[i] != -1){
+            block_unpin(&fs->dev, fs->super.beg_data + mapping->blocks[i]);
+            free_iblock(fs, mapping->blocks[i]);
+        }
+    }
+    mapping->nspans = 0;
+
+    // the file may have been unlinked and closed while mapped, it is erased
+    // with its last range, as fs_close does with its last fd
+    lock_inode(fs, inum, LOCK_WRITE);
+    current_inode = get_inode_per_inum(fs, inum);
+    if(atomic_add(&fs->map_counts[inum], -1) == 0 && !is_inode_open(fs, inum) &&
+       current_inode.link_counter == 0 && find_orphan(fs, inum) < 0){
+        free_all_data_blocks(fs, current_inode);
+        free_inode(fs, inum);
+    }
+    save_map(fs);
+    unlock_inode(fs, inum);
+    commit_op(fs);
+
+    return 0;
+}
+
+int fs_punch_hole(fs_t *session, int fd, fs_off_t offset, fs_off_t len){
+    mount_t *fs = session->mount;
+    fs_off_t end, from, to;
+    int first, last, index_block;
+    inode_t current_inode;
+
+    FileDescriptor *file = get_fd(fs, fd);
+    if(file == NULL || offset < 0 || len < 0){
+        return -1;
+    }
+
+    // check if file can be written, directories never are
+    if(file->flag == FS_O_RDONLY){
+        return -1;
+    }
+
+    lock_inode(fs, file->inode, LOCK_WRITE);
+
+    // buffered data must land before the hole is punched
+    flush_inode_fds(fs, file->inode, -1);
+
+    current_inode = get_inode_per_inum(fs, file->inode);
+
+    // blocks of a mapped range are kept until it is unmapped
+    if(is_inode_mapped(fs, file->inode)){
+        unlock_inode(fs, file->inode);
+        return -1;
+    }
+
+    // punching past the end of the file changes nothing
+    end = offset + len;
+    if(end > current_inode.size){
+        end = current_inode.size;
+    }
+    if(offset >= end){
+        unlock_inode(fs, file->inode);
+        return 0;
+    }
+
+    // blocks fully inside the hole are released, the last block of the file
+    // may be released as well since it is zeroed past the end of the file
+    first = (offset + fs->super.block_size - 1) / fs->super.block_size;
+    last = (end == current_inode.size) ? (end + fs->super.block_size - 1) / fs->super.block_size
+                                       : end / fs->super.block_size;
+
+    // zero the partial head and tail blocks, through write_file so blocks
+    // shared with clones are copied first
+    for(int i = 0; i < 2; i++){
+        index_block = (i == 0) ? offset / fs->super.block_size : last;
+        if(index_block >= first && index_block < last) continue;
+        if(i == 1 && index_block == offset / fs->super.block_size) continue;
+
+        from = ((fs_off_t) index_block * fs->super.block_size > offset) ? (fs_off_t) index_block * fs->super.block_size : offset;
+        to = ((fs_off_t) (index_block+1) * fs->super.block_size < end) ? (fs_off_t) (index_block+1) * fs->super.block_size : end;
+        if(from >= to) continue;
+
+        if(get_iblock(fs, current_inode, index_block) == -1) continue;
+
+        if(write_file(fs, file->inode, from, zero_block, to - from) != to - from){
+            unlock_inode(fs, file->inode);
+            return -1;
         }
     }
+    current_inode = get_inode_per_inum(fs, file->inode);
+
+    int ret = 0;
+    if(first < last){
+        // on failure the blocks cleared so far stay released
+        ret = clear_iblock_run(fs, &current_inode, first, last - first);
+        save_inode(fs, file->inode, current_inode); // save inode
+        save_map(fs);
+    }
+    unlock_inode(fs, file->inode);
+    commit_op(fs);
 
-    if(iblock >= 0){
-        block_write(super.beg_data + iblock, (char *) &block);
+    return ret;
+}
+
+int fs_truncate(fs_t *session, char *fileName, fs_off_t size){
+    mount_t *fs = session->mount;
+    int ret;
+    char name[MAX_FILE_NAME];
+    int dir_inum = walk_path(fs, session->cwd, fileName, name);
+    if(dir_inum < 0){
+        // printf("truncate: Path does not exist.\n");
+        return -1;
+    }
+
+    // get inode of parent
+    lock_inode(fs, dir_inum, LOCK_READ);
+    inode_t parent_inode = get_inode_per_inum(fs, dir_inum);
+
+    // check if file exists
+    int file_inum = find_file_in_dir(fs, parent_inode, name, NULL);
+    unlock_inode(fs, dir_inum);
+    if(file_inum < 0){
+        // printf("fs_truncate: File does not exist.\n");
+        return -1;
+    }
+
+    // look the name up again with both locks held, the file may have been
+    // unlinked and its inode reused in between
+    lock_inodes(fs, dir_inum, LOCK_READ, file_inum, LOCK_WRITE);
+    parent_inode = get_inode_per_inum(fs, dir_inum);
+    if(find_file_in_dir(fs, parent_inode, name, NULL) != file_inum){
+        unlock_inodes(fs, dir_inum, file_inum);
+        return -1;
+    }
+
+    // buffered data must land before the file is resized
+    flush_inode_fds(fs, file_inum, -1);
+
+    if(get_inode_per_inum(fs, file_inum).type == DIRECTORY){
+        // printf("fs_truncate: Cannot truncate a directory.\n");
+        unlock_inodes(fs, dir_inum, file_inum);
+        return -1;
     }
 
-    table[fd].rw_ptr += count;
-    if(table[fd].rw_ptr > current_inode.size){
-        current_inode.size = table[fd].rw_ptr;
-    }   
-    save_inode(table[fd].inode, current_inode); // save inode
-    save_map();
+    ret = truncate_file(fs, file_inum, size);
+    unlock_inodes(fs, dir_inum, file_inum);
+    commit_op(fs);
 
-    return count;
+    return ret;
 }
 
-int fs_lseek(int fd, int offset){
+int fs_ftruncate(fs_t *session, int fd, fs_off_t size){
+    mount_t *fs = session->mount;
+    int ret;
 
-    if(fd >= MAX_OPEN_FILES || table[fd].fd == -1){
+    // directories are never opened for writing
+    FileDescriptor *file = get_fd(fs, fd);
+    if(file == NULL || file->flag == FS_O_RDONLY){
         return -1;
     }
 
-    if(offset >= 0){
-        table[fd].rw_ptr = offset;
+    lock_inode(fs, file->inode, LOCK_WRITE);
+
+    // buffered data must land before the file is resized
+    flush_inode_fds(fs, file->inode, -1);
+
+    ret = truncate_file(fs, file->inode, size);
+    unlock_inode(fs, file->inode);
+    commit_op(fs);
+
+    return ret;
+}
+
+// Frees blocks of unlinked files, see reclaim_orphans. Returns the number
+// of orphans left, the ones still open.
+int fs_reclaim(fs_t *session, int max_blocks){
+    mount_t *fs = session->mount;
+    reclaim_orphans(fs, max_blocks);
+    commit_op(fs);
+    return fs->super.num_orphans;
+}
+
+// Drops the free data blocks from the image, so it only takes the space of
+// the blocks in use. Returns the number of blocks dropped.
+int fs_trim(fs_t *session){
+    mount_t *fs = session->mount;
+    int cnt = trim_free_blocks(fs);
+
+    sync_device(fs, FALSE);
+    return cnt;
+}
+
+int fs_fsync(fs_t *session, int fd){
+    mount_t *fs = session->mount;
+    int ret;
+
+    FileDescriptor *file = get_fd(fs, fd);
+    if(file == NULL){
+        return -1;
+    }
+
+    lock_inode(fs, file->inode, LOCK_WRITE);
+    ret = flush_fd(fs, fd);
+    unlock_inode(fs, file->inode);
+
+    // the cache is written back, not only the blocks of this file. The map
+    // of the operations done is too, even if batches deferred it.
+    sync_map(fs);
+    sync_device(fs, FALSE);
+
+    return ret;
+}
+
+// As fs_fsync, but the device only flushes the data, not its own metadata
+int fs_fdatasync(fs_t *session, int fd){
+    mount_t *fs = session->mount;
+    int ret;
+
+    FileDescriptor *file = get_fd(fs, fd);
+    if(file == NULL){
+        return -1;
+    }
+
+    lock_inode(fs, file->inode, LOCK_WRITE);
+    ret = flush_fd(fs, fd);
+    unlock_inode(fs, file->inode);
+
+    // the blocks of the file must be found again, so the map is written
+    sync_map(fs);
+    sync_device(fs, TRUE);
+
+    return ret;
+}
+
+// Writes back the data buffered by every descriptor and all the dirty
+// blocks of the cache, and makes them stable as the durability mode says.
+// Operations wait meanwhile, so the file system is consistent on disk and
+// this is a checkpoint.
+int fs_sync(fs_t *session){
+    mount_t *fs = session->mount;
+
+    flush_all_fds(fs);
+    lock_all_inodes(fs);
+    checkpoint(fs);
+    unlock_all_inodes(fs);
+    sync_device(fs, FALSE);
+
+    return 0;
+}
+
+int fs_lseek(fs_t *session, int fd, int offset){
+    return fs_lseek64(session, fd, offset);
+}
+
+fs_off_t fs_lseek64(fs_t *session, int fd, fs_off_t offset){
+    mount_t *fs = session->mount;
+
+    FileDescriptor *file = get_fd(fs, fd);
+    if(file == NULL){
+        return -1;
+    }
+
+    // no byte past the largest file size can be written
+    if(offset >= 0 && offset <= max_file_size(fs)){
+        file->rw_ptr = offset;
         return offset;
     }
 
     return -1;
 }
 
-int fs_mkdir(char *fileName){
+int fs_mkdir(fs_t *session, char *fileName){
+    mount_t *fs = session->mount;
+    char name[MAX_FILE_NAME];
+    int dir_inum = walk_path(fs, session->cwd, fileName, name);
+    if(dir_inum < 0){
+        // printf("mkdir: Path does not exist.\n");
+        return -1;
+    }
+
     //check if dir with that name already exists
-    inode_t parent_inode = get_inode_per_inum(current_dir.files_inum[0]);
-    if(find_file_in_dir(parent_inode, fileName, NULL) >= 0){
+    lock_inode(fs, dir_inum, LOCK_WRITE);
+    inode_t parent_inode = get_inode_per_inum(fs, dir_inum);
+    if(find_file_in_dir(fs, parent_inode, name, NULL) >= 0){
         // printf("mkdir: Directory already exists.\n");
+        unlock_inode(fs, dir_inum);
         return -1;
     }
-    
+
     // Allocate inode
-    int inum = get_single_available_inode();
+    int inum = get_single_available_inode(fs);
     if(inum < 0){
         // printf("mkdir: There is no inode available.\n");
+        unlock_inode(fs, dir_inum);
         return -1;
     }
 
     // allocate data blocks
-    int iblock = get_single_available_iblock();
+    int iblock = get_single_available_iblock(fs);
     if(iblock < 0){
-        free_inode(inum);
+        free_inode(fs, inum);
         // printf("mkdir: There is no data block available.\n");
+        unlock_inode(fs, dir_inum);
         return -1;
     }
 
     //set dcb of the new directory
-    dir_t new_dir = create_directory(inum);
+    dir_t new_dir = create_directory(fs, inum, dir_inum);
 
     // set inode entries
     inode_t new_inode = (inode_t) {.type = DIRECTORY,
@@ -460,221 +1070,412 @@ int fs_mkdir(char *fileName){
                                    .indirect1 = -1,
                                    .indirect2 = -1,
                                    .indirect3 = -1};
-    for(int i = 0; i < super.direct_pointers; i++)
+    for(int i = 0; i < fs->super.direct_pointers; i++)
             new_inode.direct[i] = -1;
     new_inode.direct[0] = iblock;
 
     // update parent
-    Block block;
-
-    insert_file_in_dir(&parent_inode, fileName, inum);
-    block_read(super.beg_data + parent_inode.direct[0], (char *) &block);
-    current_dir = block.data_block.dir;
-
+    if(insert_file_in_dir(fs, &parent_inode, name, inum) < 0){
+        free_iblock(fs, iblock);
+        free_inode(fs, inum);
+        save_map(fs);
+        unlock_inode(fs, dir_inum);
+        return -1;
+    }
     parent_inode.size++;
 
     // write blocks to disk
-    save_inode(inum, new_inode); // writing new inode
-    save_inode(current_dir.files_inum[0], parent_inode); // writing new inode
-
+    Block block;
     block.data_block.dir = new_dir;
-    block_write(super.beg_data + iblock, (char *) &block); // writing new data block
+    block_write(&fs->dev, fs->super.beg_data + iblock, (char *) &block); // writing new data block
 
-    block.map = map;
-    block_write(MAP_BLOCK, (char *) &block);// writing bits map
+    save_inode(fs, inum, new_inode); // writing new inode
+    save_inode(fs, dir_inum, parent_inode); // writing new inode
+    save_map(fs); // writing bits map
+    unlock_inode(fs, dir_inum);
+    commit_op(fs);
 
     return 0;
 }
 
-int fs_rmdir(char *fileName){
+int fs_rmdir(fs_t *session, char *fileName){
+    mount_t *fs = session->mount;
+    char name[MAX_FILE_NAME];
+    int dir_inum = walk_path(fs, session->cwd, fileName, name);
+    if(dir_inum < 0){
+        // printf("rmdir: Path does not exist.\n");
+        return -1;
+    }
+
+    lock_inode(fs, dir_inum, LOCK_READ);
+    inode_t parent_inode = get_inode_per_inum(fs, dir_inum);
+    int existFile = find_file_in_dir(fs, parent_inode, name, NULL);
+    unlock_inode(fs, dir_inum);
+    if(existFile < 0 || existFile == dir_inum){
+        // printf("fs_rmdir: Directory does not exist.\n");
+        return -1;
+    }
 
-    inode_t parent_inode = get_inode_per_inum(current_dir.files_inum[0]);
+    // look the name up again with both locks held, it may have changed
+    lock_inodes(fs, dir_inum, LOCK_WRITE, existFile, LOCK_WRITE);
+    parent_inode = get_inode_per_inum(fs, dir_inum);
 
-    // check if fileName exists
+    // check if name exists
     int relIndex;
-    int existFile = find_file_in_dir(parent_inode, fileName, &relIndex);
-    if(existFile < 0){
-        // printf("fs_rmdir: Directory does not exist.\n");
+    if(find_file_in_dir(fs, parent_inode, name, &relIndex) != existFile){
+        unlock_inodes(fs, dir_inum, existFile);
         return -1;
     }
 
     // check if directory is empty
-    inode_t dir_inode = get_inode_per_inum(existFile);
-    if(is_directory_empty(dir_inode) == FALSE){
+    inode_t dir_inode = get_inode_per_inum(fs, existFile);
+    if(dir_inode.type != DIRECTORY || is_directory_empty(fs, dir_inode) == FALSE){
         // printf("fs_rmdir: Directory is not empty.\n");
+        unlock_inodes(fs, dir_inum, existFile);
+        return -1;
+    }
+
+    // the working directory of a session cannot be removed
+    if(is_session_cwd(fs, existFile)){
+        unlock_inodes(fs, dir_inum, existFile);
         return -1;
     }
 
     // remove subdirectory
-    free_iblock(dir_inode.direct[0]); // free its only data block
-    free_inode(existFile); // free its inode number
+    free_iblock(fs, dir_inode.direct[0]); // free its only data block
+    free_inode(fs, existFile); // free its inode number
 
     // remove link of parent dir to subdirectory
-    remove_file_from_dir(&parent_inode, relIndex); 
+    remove_file_from_dir(fs, &parent_inode, relIndex); 
     parent_inode.size--;
 
-    // load newest current dir
-    Block aux;
-    block_read(super.beg_data + parent_inode.direct[0], (char*) &aux);
-    current_dir = aux.data_block.dir;
-
     // write to disk
-    save_inode(current_dir.files_inum[0], parent_inode); // save current dir inode
+    save_inode(fs, dir_inum, parent_inode); // save current dir inode
 
-    save_map();
+    save_map(fs);
+    dcache_forget(fs, existFile);
+    unlock_inodes(fs, dir_inum, existFile);
+    commit_op(fs);
 
     return 0;
 }
 
-int fs_cd(char *dirName){
+int fs_cd(fs_t *session, char *dirName){
+    mount_t *fs = session->mount;
+    char name[MAX_FILE_NAME];
 
-    DataBlock block;
-    inode_t parent_inode = get_inode_per_inum(current_dir.files_inum[0]);
+    int dir_inum = walk_path(fs, session->cwd, dirName, name);
+    if(dir_inum < 0){
+        // printf("cd: Path does not exist.\n");
+        return -1;
+    }
 
-    // check if fileName exists
-    int existFile = find_file_in_dir(parent_inode, dirName, NULL);
+    // check if dirName exists
+    lock_inode(fs, dir_inum, LOCK_READ);
+    inode_t parent_inode = get_inode_per_inum(fs, dir_inum);
+    int existFile = find_file_in_dir(fs, parent_inode, name, NULL);
+    unlock_inode(fs, dir_inum);
     if(existFile < 0){
         // printf("cd: Directory does not exist.\n");
         return -1;
     }
 
-    // find fileName
-    inode_t dir_inode = get_inode_per_inum(existFile);
-    if(dir_inode.type == FILE_TYPE){
+    // the directory must not be removed until it is the working one, so
+    // the name is looked up again with both locks held
+    lock_inodes(fs, dir_inum, LOCK_READ, existFile, LOCK_READ);
+    parent_inode = get_inode_per_inum(fs, dir_inum);
+    if(find_file_in_dir(fs, parent_inode, name, NULL) != existFile){
+        unlock_inodes(fs, dir_inum, existFile);
+        return -1;
+    }
+    inode_t dir_inode = get_inode_per_inum(fs, existFile);
+    if(dir_inode.type != DIRECTORY){
         // printf("cd: Target is not a directory.\n");
+        unlock_inodes(fs, dir_inum, existFile);
         return -1;
     }
 
-    // update current_dir
-    int iblock = get_iblock(dir_inode, 0);
-    block_read(super.beg_data + iblock, (char *) &block);
-
-    current_dir = block.dir;
+    // is_session_cwd reads the working directories of all the sessions
+    mutex_lock(&mounts_lock);
+    session->cwd = existFile;
+    mutex_unlock(&mounts_lock);
+    unlock_inodes(fs, dir_inum, existFile);
 
     return 0;
 }
 
-int fs_link(char *old_fileName, char *new_fileName){
-    // check if old_fileName and new_fileName exists
-    inode_t parent_inode = get_inode_per_inum(current_dir.files_inum[0]);
-    
-    int old_inode = find_file_in_dir(parent_inode, old_fileName, NULL);
+int fs_link(fs_t *session, char *old_fileName, char *new_fileName){
+    mount_t *fs = session->mount;
+    char old_name[MAX_FILE_NAME], new_name[MAX_FILE_NAME];
+    int dir_inum = walk_path(fs, session->cwd, old_fileName, old_name);
+
+    // both names must be in the same directory
+    if(dir_inum < 0 || walk_path(fs, session->cwd, new_fileName, new_name) != dir_inum){
+        // printf("link: Names are not in the same directory.\n");
+        return -1;
+    }
+
+    // check if old_name and new_name exists
+    lock_inode(fs, dir_inum, LOCK_READ);
+    inode_t parent_inode = get_inode_per_inum(fs, dir_inum);
+    int old_inode = find_file_in_dir(fs, parent_inode, old_name, NULL);
+    unlock_inode(fs, dir_inum);
     if(old_inode < 0){
         // printf("link: File does not exist.\n");
         return -1;
     }
 
-    // if new_fileName exists, finish
-    int new_inode = find_file_in_dir(parent_inode, new_fileName, NULL);
+    // look the names up again with both locks held
+    lock_inodes(fs, dir_inum, LOCK_WRITE, old_inode, LOCK_WRITE);
+    parent_inode = get_inode_per_inum(fs, dir_inum);
+    if(find_file_in_dir(fs, parent_inode, old_name, NULL) != old_inode){
+        unlock_inodes(fs, dir_inum, old_inode);
+        return -1;
+    }
+
+    // if new_name exists, finish
+    int new_inode = find_file_in_dir(fs, parent_inode, new_name, NULL);
     if(new_inode >= 0){
         // printf("link: File already exists.\n");
+        unlock_inodes(fs, dir_inum, old_inode);
         return -1;
     }
 
     // check old fileName is a FILE
-    inode_t current_inode = get_inode_per_inum(old_inode);
+    inode_t current_inode = get_inode_per_inum(fs, old_inode);
     if(current_inode.type == DIRECTORY){
         // printf("link: Target cannot a directory.\n");
+        unlock_inodes(fs, dir_inum, old_inode);
         return -1;
     }
 
-    // insert new_fileName on directory block
-    if(insert_file_in_dir(&parent_inode, new_fileName, old_inode) < 0){
+    // insert new_name on directory block
+    if(insert_file_in_dir(fs, &parent_inode, new_name, old_inode) < 0){
+        unlock_inodes(fs, dir_inum, old_inode);
         return -1;
     }
     parent_inode.size++;
 
-    Block block;
-    block_read(super.beg_data + parent_inode.direct[0], (char *) &block);
-    current_dir = block.data_block.dir;
-
-    // update inode of old_fileName on disk and memory 
+    // update inode of old_name on disk and memory 
     // if its open
     current_inode.link_counter++;
 
     // save to disk
-    save_inode(current_dir.files_inum[0], parent_inode); // save changes in parent inode
-    save_inode(old_inode, current_inode); // save changes in file inode
+    save_inode(fs, dir_inum, parent_inode); // save changes in parent inode
+    save_inode(fs, old_inode, current_inode); // save changes in file inode
+    unlock_inodes(fs, dir_inum, old_inode);
+    commit_op(fs);
 
     return 0;
 }
 
-int fs_unlink(char *fileName){
-    // check if fileName exists
-    inode_t parent_inode = get_inode_per_inum(current_dir.files_inum[0]);
-    int relIndex, fd;
-    int file_inum = find_file_in_dir(parent_inode, fileName, &relIndex);
+// Drops the references a clone took to the first n roots of its source
+static void unref_roots(mount_t *fs, int *roots, int n){
+    for(int i = 0; i < n; i++){
+        if(roots[i] != -1)
+            free_iblock(fs, roots[i]);
+    }
+}
+
+int fs_clone(fs_t *session, char *src_fileName, char *dst_fileName){
+    mount_t *fs = session->mount;
+    char src_name[MAX_FILE_NAME], dst_name[MAX_FILE_NAME];
+    int dir_inum = walk_path(fs, session->cwd, src_fileName, src_name);
+
+    // both names must be in the same directory
+    if(dir_inum < 0 || walk_path(fs, session->cwd, dst_fileName, dst_name) != dir_inum){
+        // printf("clone: Names are not in the same directory.\n");
+        return -1;
+    }
+
+    lock_inode(fs, dir_inum, LOCK_READ);
+    inode_t parent_inode = get_inode_per_inum(fs, dir_inum);
+    int src_inum = find_file_in_dir(fs, parent_inode, src_name, NULL);
+    unlock_inode(fs, dir_inum);
+    if(src_inum < 0){
+        // printf("clone: File does not exist.\n");
+        return -1;
+    }
+
+    // look the names up again with both locks held
+    lock_inodes(fs, dir_inum, LOCK_WRITE, src_inum, LOCK_WRITE);
+    parent_inode = get_inode_per_inum(fs, dir_inum);
+    if(find_file_in_dir(fs, parent_inode, src_name, NULL) != src_inum){
+        unlock_inodes(fs, dir_inum, src_inum);
+        return -1;
+    }
+
+    // the clone must be a new file
+    if(find_file_in_dir(fs, parent_inode, dst_name, NULL) >= 0){
+        // printf("clone: File already exists.\n");
+        unlock_inodes(fs, dir_inum, src_inum);
+        return -1;
+    }
+
+    // data still buffered is part of the clone
+    flush_inode_fds(fs, src_inum, -1);
+
+    inode_t src_inode = get_inode_per_inum(fs, src_inum);
+    if(src_inode.type == DIRECTORY){
+        // printf("clone: Target cannot be a directory.\n");
+        unlock_inodes(fs, dir_inum, src_inum);
+        return -1;
+    }
+
+    // the clone shares the direct blocks and the whole indirect trees of
+    // the source, each of them gains a reference
+    int roots[DIRECT_POINTERS + 3], nroots = 0;
+    for(int i = 0; i < fs->super.direct_pointers; i++)
+        roots[nroots++] = src_inode.direct[i];
+    roots[nroots++] = src_inode.indirect1;
+    roots[nroots++] = src_inode.indirect2;
+    roots[nroots++] = src_inode.indirect3;
+
+    for(int i = 0; i < nroots; i++){
+        if(roots[i] != -1 && ref_iblock(fs, roots[i]) < 0){
+            // too many references, drop the ones taken
+            unref_roots(fs, roots, i);
+            unlock_inodes(fs, dir_inum, src_inum);
+            return -1;
+        }
+    }
+
+    // Allocate inode
+    int inum = get_single_available_inode(fs);
+    if(inum < 0){
+        // printf("clone: There is no inode available.\n");
+        unref_roots(fs, roots, nroots);
+        unlock_inodes(fs, dir_inum, src_inum);
+        return -1;
+    }
+
+    // update parent
+    if(insert_file_in_dir(fs, &parent_inode, dst_name, inum) < 0){
+        free_inode(fs, inum);
+        unref_roots(fs, roots, nroots);
+        unlock_inodes(fs, dir_inum, src_inum);
+        return -1;
+    }
+    parent_inode.size++;
+
+    inode_t new_inode = src_inode;
+    new_inode.link_counter = 1;
+
+    // write blocks to disk
+    save_inode(fs, inum, new_inode); // writing new inode
+    save_inode(fs, dir_inum, parent_inode); // save changes in parent inode
+    save_map(fs);
+    unlock_inodes(fs, dir_inum, src_inum);
+    commit_op(fs);
+
+    return 0;
+}
+
+int fs_unlink(fs_t *session, char *fileName){
+    mount_t *fs = session->mount;
+    char name[MAX_FILE_NAME];
+    int dir_inum = walk_path(fs, session->cwd, fileName, name);
+    if(dir_inum < 0){
+        // printf("unlink: Path does not exist.\n");
+        return -1;
+    }
+
+    // check if name exists
+    lock_inode(fs, dir_inum, LOCK_READ);
+    inode_t parent_inode = get_inode_per_inum(fs, dir_inum);
+    int file_inum = find_file_in_dir(fs, parent_inode, name, NULL);
+    unlock_inode(fs, dir_inum);
     if(file_inum < 0){
         // printf("unlink: File does not exist.\n");
         return -1;
     }
 
+    // look the name up again with both locks held
+    lock_inodes(fs, dir_inum, LOCK_WRITE, file_inum, LOCK_WRITE);
+    parent_inode = get_inode_per_inum(fs, dir_inum);
+    int relIndex;
+    if(find_file_in_dir(fs, parent_inode, name, &relIndex) != file_inum){
+        unlock_inodes(fs, dir_inum, file_inum);
+        return -1;
+    }
+
     // check if it is a directory
-    inode_t current_inode = get_inode_per_inum(file_inum);
+    inode_t current_inode = get_inode_per_inum(fs, file_inum);
     if(current_inode.type == DIRECTORY){
         // printf("unlink: Target cannot a directory.\n");
+        unlock_inodes(fs, dir_inum, file_inum);
         return -1;
     }
 
     // remove link of parent dir to subdirectory
-    remove_file_from_dir(&parent_inode, relIndex);
+    remove_file_from_dir(fs, &parent_inode, relIndex);
     parent_inode.size--;
 
     // update link counter of inode on disk and memory
     current_inode.link_counter--;
 
-    for(fd = 0; fd < MAX_OPEN_FILES; fd++){
-        if(table[fd].fd != -1 && same_string(table[fd].name, fileName))
-            break;
-    }
+    save_inode(fs, file_inum, current_inode); 
 
-    if(current_inode.link_counter == 0 && fd == MAX_OPEN_FILES){
-        // erase file
+    // a file without links is put on the orphan list and its blocks are
+    // freed later by fs_reclaim, so a large file does not stall the caller
+    if(current_inode.link_counter == 0 && add_orphan(fs, file_inum) < 0 &&
+       !is_inode_open(fs, file_inum) && !is_inode_mapped(fs, file_inum)){
+        // the orphan list is full, erase file now
 
         // free all data blocks associate with this file
-        free_all_data_blocks(current_inode);
+        free_all_data_blocks(fs, current_inode);
 
         // free its inode
-        free_inode(file_inum);
-    }else{
-        save_inode(file_inum, current_inode); 
+        free_inode(fs, file_inum);
     }
 
-    // load newest current dir
-    Block aux;
-    block_read(super.beg_data + parent_inode.direct[0], (char*) &aux);
-    current_dir = aux.data_block.dir;
-
     // write to disk
-    save_inode(current_dir.files_inum[0], parent_inode); // save current dir inode
+    save_inode(fs, dir_inum, parent_inode); // save current dir inode
 
-    save_map(); 
+    save_map(fs); 
+    unlock_inodes(fs, dir_inum, file_inum);
+    commit_op(fs);
 
     return 0;
 }
 
-int fs_stat(char *fileName, fileStat *buf){
+int fs_stat(fs_t *session, char *fileName, fileStat *buf){
+    mount_t *fs = session->mount;
+    char name[MAX_FILE_NAME];
+    int dir_inum = walk_path(fs, session->cwd, fileName, name);
+    if(dir_inum < 0){
+        // printf("stat: Path does not exist.\n");
+        return -1;
+    }
 
     // get inode of parent
-    inode_t parent_inode = get_inode_per_inum(current_dir.files_inum[0]);
+    lock_inode(fs, dir_inum, LOCK_READ);
+    inode_t parent_inode = get_inode_per_inum(fs, dir_inum);
 
     // check if file exists
-    int file_inum = find_file_in_dir(parent_inode, fileName, NULL);
+    int file_inum = find_file_in_dir(fs, parent_inode, name, NULL);
+    unlock_inode(fs, dir_inum);
     if(file_inum < 0){
         // printf("fs_stat: File does not exist.\n");
         return -1;
     }
 
-    // get inode of fileName
-    inode_t file_inode = get_inode_per_inum(file_inum);
+    // get inode of name, with its buffered data
+    sync_inode_fds(fs, file_inum);
 
-    // set buf
-    int num_blocks;
-    if(file_inode.type == DIRECTORY){
-        num_blocks = (file_inode.size + super.pointers_per_dcb-1) / super.pointers_per_dcb;
-    }else{
-        num_blocks = (file_inode.size + super.block_size-1) / super.block_size;  
-    } 
+    // look the name up again with both locks held, the file may have been
+    // unlinked and its inode reused in between
+    lock_inodes(fs, dir_inum, LOCK_READ, file_inum, LOCK_READ);
+    parent_inode = get_inode_per_inum(fs, dir_inum);
+    if(find_file_in_dir(fs, parent_inode, name, NULL) != file_inum){
+        unlock_inodes(fs, dir_inum, file_inum);
+        return -1;
+    }
+    inode_t file_inode = get_inode_per_inum(fs, file_inum);
+
+    // set buf, holes of sparse files are not counted as allocated blocks
+    int num_blocks = count_iblocks(fs, file_inode);
+    unlock_inodes(fs, dir_inum, file_inum);
     *buf = (fileStat) {.inodeNo = file_inum,
                        .type = file_inode.type,
                        .links = file_inode.link_counter,
@@ -683,10 +1484,3 @@ int fs_stat(char *fileName, fileStat *buf){
     return 0;
 }
 
-int fs_fsck(fsCheck *buf){
-    *buf = (fsCheck) {.magic_number = super.magic_number,
-                      .inodes_allocated = inodes_used(),
-                      .blocks_allocated = blocks_used(),
-                      .map = map};
-    return 0;
-}
@@ -4,25 +4,48 @@
 #include "common.h"
 #include "block.h"
 
-#define FS_SIZE 2048
+#define FS_SIZE 2048 // Blocks of the image formatted by fs_mkfs, see fs_mkfs_geometry
+#define FS_BYTES_PER_INODE 512 // Bytes of image per inode formatted by fs_mkfs
 #define MAX_FILE_NAME 28
 #define MAX_PATH_NAME 256  // This is the maximum supported "full" path len, eg: /foo/bar/test.txt, rather than the maximum individual filename len.
-#define MAX_OPEN_FILES 256
+#define MAX_OPEN_FILES 65536 // Number of files open at once, on all the file systems
 #define MAGIC_NUMBER 0x42 // Life, The Universe and Everything
 
-#define INODES_BLOCKS 256
 #define INODES_PER_BLOCK 8 // Must be less than or equal to 8
 #define DIRECT_POINTERS 10 
 #define POINTERS_PER_DCB 16
+#define BLOCK_RUN 64 // Number of block pointers resolved at once when reading a file
+#define MAX_WRITE_BUFFERS 64 // Number of dirty write-behind buffers kept before all of them are flushed
+#define MAX_MAP_SPANS 64 // Number of blocks a single fs_map_range can pin
+#define MAX_ORPHANS 64 // Number of unlinked files waiting to be reclaimed
+#define RECLAIM_BATCH 64 // Number of blocks of unlinked files the shell reclaims between commands
+#define ASYNC_QUEUE_DEPTH 256 // Number of asynchronous operations that can be in flight
+#define ASYNC_WORKERS 4 // Number of threads running asynchronous operations
+#define ASYNC_BATCH 16 // Number of asynchronous operations a worker runs at once
+#define MAP_BATCH_DEFER (ASYNC_BATCH * ASYNC_WORKERS) // Number of saves of the map batches may defer before it is written anyway
+#define FSCK_WORKERS 4 // Number of threads scanning the inode table in fs_fsck
+#define FSCK_RANGE 8 // Number of blocks of the inode table a worker of fs_fsck takes at once
+#define INODE_LOCK_STRIPES 64 // Number of locks shared by the inodes
+#define FREE_LIST_RUNS 64 // Number of runs of freed blocks kept before they are cleared from the map
+#define MAX_MOUNTS 16 // Number of file systems mounted at once
+#define MAX_SESSIONS 64 // Number of sessions open at once, on all the file systems
+#define DCACHE_ENTRIES 256 // Number of directories cached by the path walks of a file system
+#define FD_CHUNK 256 // Number of descriptors a table of open files grows by
+#define FD_SHARDS 8 // Number of free lists of a table of open files
+#define DURABLE_PERIOD_MS 1000 // Period of the device flushes of FS_MOUNT_DURABLE_PERIODIC
+#define DIRTY_ITABLE_BITS 1024 // Bits of the superblock recording the changed blocks of the inode table
+#define FS_HEAP_SIZE (4 << 20) // Bytes of the tables sized by the geometry, in the kernel build, see fs_alloc
 
 // the following defines are just to make the code cleaner
-#define INODES_NUMBER INODES_BLOCKS * INODES_PER_BLOCK
-#define DATA_BLOCKS FS_SIZE - 2 - INODES_BLOCKS
-#define IMAP_BYTES (INODES_NUMBER+7)/8
-#define DMAP_BYTES (DATA_BLOCKS+7)/8
-#define MAP_BLOCK 1 +INODES_BLOCKS
+#define REFS_PER_BLOCK (BLOCK_SIZE/2)
+#define MAX_BLOCK_REFS 0xFFFF
+#define MAP_BITS (BLOCK_SIZE*8) // bits of a block of the map
+#define MAX_IO_COUNT 0x7FFFFFFF // bytes a single read or write may move, its result is an int
 
 // superblock
+// The image holds the superblock, the inode table and the inodes map, then
+// the data blocks, followed by the blocks map and the reference counts
+// table, which are sized by them. Both maps take whole blocks.
 typedef struct{
 
 	// metadata of the disk
@@ -31,11 +54,16 @@ typedef struct{
 	uint32_t num_inodes; // 4 bytes
 	uint32_t num_data_blocks; // 4 bytes
 	uint32_t num_blocks_inodes; // 4 bytes
+	uint32_t num_imap_blocks; // 4 bytes
+	uint32_t num_dmap_blocks; // 4 bytes
+	uint32_t num_refcount_blocks; // 4 bytes
 
 	// pointer to beginning of important sectors
 	uint32_t beg_inodes; // 4 bytes
-	uint32_t beg_map; // 4 bytes
+	uint32_t beg_imap; // 4 bytes
 	uint32_t beg_data; // 4 bytes
+	uint32_t beg_dmap; // 4 bytes
+	uint32_t beg_refcount; // 4 bytes
 
 	// Important 
 	uint32_t pointers_per_block; // 4 bytes
@@ -44,24 +72,33 @@ typedef struct{
 	uint32_t direct_pointers; // 4 bytes
 	
 	uint32_t magic_number; // 4 byte
-} superblock_t; // Total size = 52 bytes
+
+	// inodes whose last link is gone and whose blocks are not freed yet
+	uint32_t num_orphans; // 4 bytes
+	int32_t orphans[MAX_ORPHANS]; // 4 * 64 = 256 bytes
+
+	// blocks of the inode table changed since the last checkpoint, one bit
+	// for each dirty_itable_span of them
+	uint32_t dirty_itable_span; // 4 bytes
+	int32_t dirty_itable[DIRTY_ITABLE_BITS/32]; // 4 * 32 = 128 bytes
+} superblock_t; // Total size = 464 bytes
 
 // inode
 typedef struct{
-	int type; // 4 bytes
-	int link_counter; // 4 bytes
-	int size; // 4 bytes
+	fs_off_t size; // 8 bytes
+	int16_t type; // 2 bytes
+	int16_t link_counter; // 2 bytes
 	int direct[DIRECT_POINTERS]; // 4 * 10  = 40 bytes
 	int indirect1; // 4 byte
 	int indirect2; // 4 byte
 	int indirect3; // 4 byte
 } inode_t; // Total size = 64 bytes
 
-// bits map
+// bits map, in memory, see alloc_tables
 typedef struct{
-	char imap[IMAP_BYTES]; // 20 bytes
-	char dmap[DMAP_BYTES]; // 32 bytes
-} bmap_t; // Total size = 52 bytes
+	char *imap; // num_imap_blocks blocks, a bit per inode
+	char *dmap; // num_dmap_blocks blocks, a bit per data block
+} bmap_t;
 
 // data block
 // directory structure
@@ -78,9 +115,9 @@ typedef union{
 
 // block
 typedef union{
-	superblock_t sb; // superblock (52 bytes)
+	superblock_t sb; // superblock (464 bytes)
 	inode_t inodes[INODES_PER_BLOCK]; // inodes (8 * 64 = 512 bytes)
-	bmap_t map; // bits map (52 bytes)
+	uint16_t refs[REFS_PER_BLOCK]; // reference counts table (512 bytes)
 	DataBlock data_block; // data block (512 bytes)
 } Block; // Total size = 512 bytes
 
@@ -88,32 +125,153 @@ typedef struct{
 	uint32_t magic_number;
 	int blocks_allocated;
 	int inodes_allocated;
-	bmap_t map;
+	bmap_t map; // the map of the file system, which keeps changing once fs_fsck returns
+
+	// inconsistencies found, fixed if FS_FSCK_REPAIR is given
+	int errors; // all of the ones below
+	int bad_imap; // live inodes free in the map
+	int bad_dmap; // blocks in use free in the map, or the other way round
+	int bad_refs; // wrong entries of the reference counts table
+	int bad_links; // inodes whose link count is not their number of entries
+	int bad_pointers; // block pointers out of the data area
+	int bad_entries; // directory or orphan list entries naming no inode
+	int unreachable; // inodes in the map that no entry names
 } fsCheck;
 
-// Open-files table
+// Entry of the open-files table
 typedef struct{
-	int fd;
-	char name[MAX_PATH_NAME];
+	int fd; // -1 if the entry is free
 	int inode;
 	int flag;
-	int rw_ptr;
+	int wbuf; // write-behind buffer holding its data, -1 if none
+	fs_off_t rw_ptr;
+	int next_free; // next entry of the free list, while the entry is free
+	bool_t wbuf_error; // set if writing the buffer back has failed
 } FileDescriptor; 
 
-void fs_init(void);
-int fs_mkfs(void);
-
-int fs_open(char *fileName, int flags);
-int fs_close(int fd);
-int fs_read(int fd, char *buf, int count);
-int fs_write(int fd, char *buf, int count);
-int fs_lseek(int fd, int offset);
-int fs_mkdir(char *fileName); 
-int fs_rmdir(char *fileName); 
-int fs_cd(char *dirName);
-int fs_link(char *old_fileName, char *new_fileName);
-int fs_unlink(char *fileName);
-int fs_stat(char *fileName, fileStat *buf);
-int fs_fsck(fsCheck *buf);
+// Data blocks freed but not yet cleared from the map of bits, kept as runs
+typedef struct{
+	int nruns;
+	int start[FREE_LIST_RUNS]; // first block of each run
+	int len[FREE_LIST_RUNS]; // number of blocks of each run
+} free_list_t;
+
+// Buffer of a vectored I/O
+typedef struct{
+	char *base;
+	int len;
+} iovec_t;
+
+// Position of a vectored I/O on its buffers
+typedef struct{
+	iovec_t *iov;
+	int iovcnt;
+	int index; // current buffer
+	int offset; // offset on the current buffer
+} iov_cursor_t;
+
+// Range of a file mapped in memory by fs_map_range
+typedef struct{
+	int inode; // file mapped, its blocks are kept until fs_unmap_range
+	int nspans; // number of spans mapped
+	iovec_t spans[MAX_MAP_SPANS]; // read-only memory of the range, in order
+	int blocks[MAX_MAP_SPANS]; // block pinned and referenced for each span, -1 for holes
+} fsMapping;
+
+// A session on a mounted file system, see fs_mount and fs_session_open
+typedef struct fs fs_t;
+
+// Options of fs_mount
+#define FS_MOUNT_FORMAT 1 // format the image if it holds no file system
+#define FS_MOUNT_DISCARD (1 << 3) // drop freed blocks from the image, see fs_trim
+
+// Durability modes, one of them is or-ed into the options of fs_mount.
+// Blocks are written back in block order, not in the order of the
+// operations, so after a crash only what the mode promises holds.
+#define FS_MOUNT_DURABLE_FSYNC (0 << 1) // the default, operations returned before fs_fsync, fs_fdatasync or fs_sync is called are stable once it returns
+#define FS_MOUNT_DURABLE_NONE (1 << 1) // nothing is flushed, fs_fsync and fs_sync only write the cache back
+#define FS_MOUNT_DURABLE_PERIODIC (2 << 1) // as FSYNC, and the device is flushed every DURABLE_PERIOD_MS
+#define FS_MOUNT_DURABLE_OP (3 << 1) // operations changing the file system are stable when they return, in the order they return
+#define FS_MOUNT_DURABLE_MASK (3 << 1)
+
+// Options of fs_fsck
+#define FS_FSCK_REPAIR 1 // fix what is found
+#define FS_FSCK_DIRTY 2 // only check the inodes changed since the last checkpoint, and the whole file system if they are wrong and FS_FSCK_REPAIR is given
+
+// Modes of the inode locks
+#define LOCK_READ 0
+#define LOCK_WRITE 1
+
+// Operations of the asynchronous interface
+#define FS_OP_OPEN 0
+#define FS_OP_CLOSE 1
+#define FS_OP_READ 2
+#define FS_OP_WRITE 3
+#define FS_OP_STAT 4
+#define FS_OP_MKDIR 5
+#define FS_OP_UNLINK 6
+
+// Operation submitted by fs_submit
+typedef struct{
+	int opcode; // FS_OP_*
+	char *fileName; // open, stat, mkdir and unlink
+	int flags; // open
+	int fd; // close, read and write
+	char *buf; // read and write
+	int count; // read and write
+	fs_off_t offset; // read and write, -1 to use the file pointer
+	fileStat *stat; // stat
+	void *user_data; // handed back with the completion
+	fs_t *session; // set by fs_submit
+} fsOp;
+
+// Result of an operation, returned by fs_reap
+typedef struct{
+	int ret; // what the synchronous call returns
+	void *user_data;
+} fsCompletion;
+
+fs_t *fs_mount(char *path, int options);
+int fs_umount(fs_t *fs);
+fs_t *fs_session_open(fs_t *fs);
+int fs_session_close(fs_t *fs);
+int fs_mkfs(fs_t *fs);
+int fs_mkfs_geometry(fs_t *fs, fs_off_t size, int bytes_per_inode);
+
+int fs_open(fs_t *fs, char *fileName, int flags);
+int fs_close(fs_t *fs, int fd);
+int fs_read(fs_t *fs, int fd, char *buf, int count);
+int fs_write(fs_t *fs, int fd, char *buf, int count);
+int fs_pread(fs_t *fs, int fd, char *buf, int count, int offset);
+int fs_pwrite(fs_t *fs, int fd, char *buf, int count, int offset);
+int fs_pread64(fs_t *fs, int fd, char *buf, int count, fs_off_t offset);
+int fs_pwrite64(fs_t *fs, int fd, char *buf, int count, fs_off_t offset);
+int fs_readv(fs_t *fs, int fd, iovec_t *iov, int iovcnt);
+int fs_writev(fs_t *fs, int fd, iovec_t *iov, int iovcnt);
+int fs_copy_range(fs_t *fs, int fd_in, fs_off_t off_in, int fd_out, fs_off_t off_out, int len);
+int fs_map_range(fs_t *fs, int fd, fs_off_t offset, int len, fsMapping *mapping);
+int fs_unmap_range(fs_t *fs, fsMapping *mapping);
+int fs_lseek(fs_t *fs, int fd, int offset);
+fs_off_t fs_lseek64(fs_t *fs, int fd, fs_off_t offset);
+int fs_punch_hole(fs_t *fs, int fd, fs_off_t offset, fs_off_t len);
+int fs_truncate(fs_t *fs, char *fileName, fs_off_t size);
+int fs_ftruncate(fs_t *fs, int fd, fs_off_t size);
+int fs_fsync(fs_t *fs, int fd);
+int fs_fdatasync(fs_t *fs, int fd);
+int fs_sync(fs_t *fs);
+int fs_reclaim(fs_t *fs, int max_blocks);
+int fs_trim(fs_t *fs);
+int fs_resize(fs_t *fs, fs_off_t size);
+int fs_mkdir(fs_t *fs, char *fileName); 
+int fs_rmdir(fs_t *fs, char *fileName); 
+int fs_cd(fs_t *fs, char *dirName);
+int fs_link(fs_t *fs, char *old_fileName, char *new_fileName);
+int fs_unlink(fs_t *fs, char *fileName);
+int fs_clone(fs_t *fs, char *src_fileName, char *dst_fileName);
+int fs_stat(fs_t *fs, char *fileName, fileStat *buf);
+int fs_fsck(fs_t *fs, fsCheck *buf, int options);
+
+int fs_submit(fs_t *fs, fsOp *ops, int nops);
+int fs_reap(fs_t *fs, fsCompletion *completions, int max, int min);
 
 #endif
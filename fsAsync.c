@@ -0,0 +1,254 @@
+/*  fsAsync.c
+
+    Asynchronous interface to the file system. Operations are queued by
+    fs_submit and executed by a small pool of workers, their results are
+    collected with fs_reap. Each worker runs a batch of queued operations
+    at a time and writes the map of bits once for the whole batch.
+
+    The workers run their batches concurrently, next to any synchronous
+    fs_* calls, the file system locks what each operation touches. Batches
+    may run in any order: an operation that depends on another one, like a
+    write on the descriptor of an open, is submitted once the first one is
+    reaped.
+
+    Each mounted file system has its own rings and workers, see async_t.
+    Operations run in the session that submitted them, so relative names
+    are looked up from its working directory.
+    Without threads (the kernel build), operations are executed by fs_reap
+    on the caller's thread, still in batches.
+*/
+
+#include "util.h"
+#include "common.h"
+#include "block.h"
+#include "fs.h"
+#include "fsUtil.h"
+#include "lock.h"
+
+// Queued operations and their completions are both rings. The number of
+// operations in flight, submitted and not reaped yet, is bound by the size
+// of the rings, so workers always find room for their completions.
+
+// Run a single operation, returns what the synchronous call would
+static int run_op(fsOp *op){
+    fs_t *session = op->session;
+
+    switch(op->opcode){
+        case FS_OP_OPEN:
+            return fs_open(session, op->fileName, op->flags);
+        case FS_OP_CLOSE:
+            return fs_close(session, op->fd);
+        case FS_OP_READ:
+            if(op->offset < 0) return fs_read(session, op->fd, op->buf, op->count);
+            return fs_pread64(session, op->fd, op->buf, op->count, op->offset);
+        case FS_OP_WRITE:
+            if(op->offset < 0) return fs_write(session, op->fd, op->buf, op->count);
+            return fs_pwrite64(session, op->fd, op->buf, op->count, op->offset);
+        case FS_OP_STAT:
+            return fs_stat(session, op->fileName, op->stat);
+        case FS_OP_MKDIR:
+            return fs_mkdir(session, op->fileName);
+        case FS_OP_UNLINK:
+            return fs_unlink(session, op->fileName);
+    }
+    return -1;
+}
+
+/*
+    Run a batch of operations, in the order they were submitted. The map of
+    bits is written once the batches running are done, instead of once per
+    operation, but in FS_MOUNT_DURABLE_OP.
+*/
+static void run_batch(mount_t *fs, fsOp *ops, fsCompletion *done, int n){
+    // each operation is stable on its own, map included
+    bool_t batch = (fs->durability != FS_MOUNT_DURABLE_OP);
+
+    if(batch) begin_map_batch(fs);
+    for(int i = 0; i < n; i++){
+        done[i].ret = run_op(&ops[i]);
+        done[i].user_data = ops[i].user_data;
+    }
+    if(batch) end_map_batch(fs);
+}
+
+// Take up to ASYNC_BATCH operations off the submission ring
+static int take_batch(async_t *aq, fsOp *ops){
+    int n = 0;
+    while(aq->sq_len > 0 && n < ASYNC_BATCH){
+        ops[n++] = aq->sq[aq->sq_head];
+        aq->sq_head = (aq->sq_head + 1) % ASYNC_QUEUE_DEPTH;
+        aq->sq_len--;
+    }
+    return n;
+}
+
+// Put completions on the completion ring
+static void post_completions(async_t *aq, fsCompletion *done, int n){
+    for(int i = 0; i < n; i++){
+        aq->cq[(aq->cq_head + aq->cq_len) % ASYNC_QUEUE_DEPTH] = done[i];
+        aq->cq_len++;
+    }
+}
+
+#ifdef FAKE
+static void *worker_main(void *arg){
+    mount_t *fs = (mount_t *) arg;
+    async_t *aq = &fs->async;
+    fsOp ops[ASYNC_BATCH];
+    fsCompletion done[ASYNC_BATCH];
+    int n;
+
+    while(1){
+        mutex_lock(&aq->queue_lock);
+        while(aq->sq_len == 0 && !aq->stopping){
+            cond_wait(&aq->work_ready, &aq->queue_lock);
+        }
+        if(aq->sq_len == 0){
+            // stopping and nothing left to run
+            mutex_unlock(&aq->queue_lock);
+            return NULL;
+        }
+        n = take_batch(aq, ops);
+        mutex_unlock(&aq->queue_lock);
+
+        run_batch(fs, ops, done, n);
+
+        mutex_lock(&aq->queue_lock);
+        post_completions(aq, done, n);
+        cond_broadcast(&aq->work_done);
+        mutex_unlock(&aq->queue_lock);
+    }
+}
+
+// Start the workers, the first time operations are submitted
+static void start_workers(mount_t *fs){
+    async_t *aq = &fs->async;
+
+    if(aq->started) return;
+
+    for(int i = 0; i < ASYNC_WORKERS; i++){
+        thread_create(&aq->workers[i], worker_main, fs);
+    }
+    aq->started = TRUE;
+}
+#endif
+
+// Set up the rings of a file system being mounted, no worker is started
+// until operations are submitted
+void init_async(mount_t *fs){
+    async_t *aq = &fs->async;
+
+    aq->sq_head = aq->sq_len = 0;
+    aq->cq_head = aq->cq_len = 0;
+    aq->in_flight = 0;
+    mutex_init(&aq->queue_lock);
+    cond_init(&aq->work_ready);
+    cond_init(&aq->work_done);
+    aq->started = aq->stopping = FALSE;
+}
+
+// Run the operations still queued and stop the workers, for fs_umount.
+// Completions not reaped are dropped.
+void stop_async(mount_t *fs){
+    async_t *aq = &fs->async;
+
+#ifdef FAKE
+    if(aq->started){
+        mutex_lock(&aq->queue_lock);
+        aq->stopping = TRUE;
+        cond_broadcast(&aq->work_ready);
+        mutex_unlock(&aq->queue_lock);
+
+        for(int i = 0; i < ASYNC_WORKERS; i++){
+            thread_join(aq->workers[i]);
+        }
+        aq->started = FALSE;
+    }
+#else
+    fsOp ops[ASYNC_BATCH];
+    fsCompletion done[ASYNC_BATCH];
+    while(aq->sq_len > 0){
+        int cnt = take_batch(aq, ops);
+        run_batch(fs, ops, done, cnt);
+    }
+#endif
+
+    aq->cq_head = aq->cq_len = 0;
+    aq->in_flight = 0;
+}
+
+/*
+    Queue nops operations. Returns the number of them queued, which is less
+    than nops when too many operations are in flight, or -1 on a bad
+    operation. The buffers, names and stat structures of the operations
+    must stay valid until they are reaped.
+*/
+int fs_submit(fs_t *session, fsOp *ops, int nops){
+    mount_t *fs = session->mount;
+    async_t *aq = &fs->async;
+    int n;
+
+    for(int i = 0; i < nops; i++){
+        if(ops[i].opcode < FS_OP_OPEN || ops[i].opcode > FS_OP_UNLINK){
+            return -1;
+        }
+    }
+
+    mutex_lock(&aq->queue_lock);
+#ifdef FAKE
+    start_workers(fs);
+#endif
+
+    for(n = 0; n < nops && aq->in_flight < ASYNC_QUEUE_DEPTH; n++){
+        fsOp *op = &aq->sq[(aq->sq_head + aq->sq_len) % ASYNC_QUEUE_DEPTH];
+        *op = ops[n];
+        op->session = session;
+        aq->sq_len++;
+        aq->in_flight++;
+    }
+
+    cond_broadcast(&aq->work_ready);
+    mutex_unlock(&aq->queue_lock);
+
+    return n;
+}
+
+/*
+    Collect the results of up to max operations, waiting until at least
+    min of them are done. Completions come in the order operations finish.
+    Returns the number of completions collected.
+*/
+int fs_reap(fs_t *session, fsCompletion *completions, int max, int min){
+    mount_t *fs = session->mount;
+    async_t *aq = &fs->async;
+    int n = 0;
+
+    mutex_lock(&aq->queue_lock);
+    if(min > aq->in_flight) min = aq->in_flight;
+    if(min > max) min = max;
+
+#ifdef FAKE
+    while(aq->cq_len < min){
+        cond_wait(&aq->work_done, &aq->queue_lock);
+    }
+#else
+    fsOp ops[ASYNC_BATCH];
+    fsCompletion done[ASYNC_BATCH];
+    while(aq->cq_len < min){
+        int cnt = take_batch(aq, ops);
+        run_batch(fs, ops, done, cnt);
+        post_completions(aq, done, cnt);
+    }
+#endif
+
+    while(n < max && aq->cq_len > 0){
+        completions[n++] = aq->cq[aq->cq_head];
+        aq->cq_head = (aq->cq_head + 1) % ASYNC_QUEUE_DEPTH;
+        aq->cq_len--;
+        aq->in_flight--;
+    }
+
+    mutex_unlock(&aq->queue_lock);
+
+    return n;
+}
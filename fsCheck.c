@@ -0,0 +1,619 @@
+/*  fsCheck.c
+
+    Consistency check of a mounted file system. fs_fsck rebuilds, from the
+    file system itself, what the bits map, the reference counts table and
+    the link counts should hold, compares them with what they do hold and,
+    given FS_FSCK_REPAIR, rewrites them.
+
+    The check runs in three steps, with every inode lock and the allocator
+    lock held, so the file system stands still:
+
+    1. The directory tree is walked from the root, breadth first. Every
+       inode named by an entry, and every inode on the orphan list, is
+       live. Entries are counted into the expected link counts. Entries
+       naming a free inode, or a directory already found, are bad.
+    2. The inode table is scanned by FSCK_WORKERS threads, FSCK_RANGE
+       blocks of it at a time. The block trees of the live inodes are
+       walked and the blocks found are marked in a bitmap shared by the
+       workers. A block found a second time is shared, it gains an extra
+       reference and its subtree is not walked again.
+    3. The bitmaps built are compared with the map of bits, and the extra
+       references with the reference counts table.
+
+    With FS_FSCK_DIRTY, only the blocks of the inode table changed since
+    the last checkpoint are scanned, see mark_itable_dirty, and the tree is
+    not walked. The blocks of their inodes must be in the map, and the
+    entries of their directories must name inodes in use, as many times as
+    their link count says, since links are always in a single directory.
+    Blocks and inodes leaked are left to the full check.
+
+    Without threads (the kernel build), the inode table is scanned by the
+    caller, a range after the other.
+*/
+
+#include "util.h"
+#include "common.h"
+#include "block.h"
+#include "fs.h"
+#include "fsUtil.h"
+#include "lock.h"
+
+// State of a check. There is a single one, fsck_lock lets one check run at
+// a time, on all the file systems. Its tables are sized by the geometry of
+// the file system checked, see fsck_alloc.
+typedef struct{
+    mount_t *fs;
+    bool_t repair;
+    bool_t dirty_only; // FS_FSCK_DIRTY
+    fsCheck *check; // counters of what was found, added to atomically
+
+    char *live; // inodes found by the walk of step 1, or orphans when dirty_only
+    int *links; // entries naming each inode
+    int *queue; // directories to walk, each one queued once
+    int *parent; // directory holding the entry of each directory
+
+    int *seen; // blocks found by step 2, a bit each, set atomically
+    uint16_t *extra; // times each block was found, besides the first, wrapping past MAX_BLOCK_REFS like the table would
+    int next_range; // first block of the inode table not taken by a worker
+} fsck_t;
+
+static fsck_t fsck_state;
+static mutex_t fsck_lock = MUTEX_INITIALIZER;
+
+#define IS_SET(map, i) (((map)[(i)/8] & (1<<(7-(i)%8))) != 0)
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+/*
+    Step 1, the directory tree
+*/
+
+// Returns TRUE if a directory entry may name the given inode
+static bool_t entry_ok(fsck_t *ck, int inum){
+    mount_t *fs = ck->fs;
+    inode_t inode;
+
+    if(inum < 0 || inum >= fs->super.num_inodes) return FALSE;
+
+    inode = get_inode_per_inum(fs, inum);
+    if(inode.type == FILE_TYPE) return TRUE;
+
+    // a directory has a single entry, this also rules out loops
+    return (inode.type == DIRECTORY && !ck->live[inum]);
+}
+
+// Walk the entries of a directory, queueing the directories they name
+static void walk_dir(fsck_t *ck, int dir, int *tail){
+    mount_t *fs = ck->fs;
+    int ppd = fs->super.pointers_per_dcb;
+    int loaded = -1, iblock = -1, child;
+    inode_t inode = get_inode_per_inum(fs, dir);
+    DataBlock block;
+
+    for(int i = 0; i < inode.size; i++){
+        if(i / ppd != loaded){
+            iblock = get_iblock(fs, inode, i / ppd);
+            // a bad pointer, counted by step 2, the rest can't be read
+            if(iblock < 0 || iblock >= fs->super.num_data_blocks) return;
+            block_read(&fs->dev, fs->super.beg_data + iblock, (char *) &block);
+            loaded = i / ppd;
+        }
+        child = block.dir.files_inum[i % ppd];
+
+        // '.' and '..'
+        if(i < 2){
+            int expected = (i == 0) ? dir : ck->parent[dir];
+            if(child != expected){
+                atomic_add(&ck->check->bad_entries, 1);
+                if(ck->repair){
+                    block.dir.files_inum[i] = expected;
+                    block_write(&fs->dev, fs->super.beg_data + iblock, (char *) &block);
+                }
+            }
+            continue;
+        }
+
+        if(!entry_ok(ck, child)){
+            atomic_add(&ck->check->bad_entries, 1);
+            if(ck->repair){
+                // the last entry takes its place, look at it again
+                remove_file_from_dir(fs, &inode, i);
+                inode.size--;
+                save_inode(fs, dir, inode);
+                loaded = -1;
+                i--;
+            }
+            continue;
+        }
+
+        ck->links[child]++;
+        if(!ck->live[child]){
+            ck->live[child] = TRUE;
+            ck->parent[child] = dir;
+            if(get_inode_per_inum(fs, child).type == DIRECTORY)
+                ck->queue[(*tail)++] = child;
+        }
+    }
+}
+
+// Find the live inodes, returns -1 if there is no root directory to start from
+static int walk_tree(fsck_t *ck){
+    mount_t *fs = ck->fs;
+    int head = 0, tail = 0, inum;
+
+    if(get_inode_per_inum(fs, 0).type != DIRECTORY) return -1;
+
+    ck->live[0] = TRUE;
+    ck->parent[0] = 0;
+    ck->queue[tail++] = 0;
+    while(head < tail){
+        walk_dir(ck, ck->queue[head++], &tail);
+    }
+
+    // unlinked files are live until they are reclaimed
+    for(int i = 0; i < (int) fs->super.num_orphans; ){
+        inum = fs->super.orphans[i];
+        if(inum >= 0 && inum < fs->super.num_inodes && IS_SET(fs->map.imap, inum) &&
+           get_inode_per_inum(fs, inum).type == FILE_TYPE){
+            ck->live[inum] = TRUE;
+            i++;
+            continue;
+        }
+
+        atomic_add(&ck->check->bad_entries, 1);
+        if(!ck->repair){
+            i++;
+            continue;
+        }
+        remove_orphan(fs, inum); // the last orphan takes its place
+    }
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+/*
+    Step 2, the block trees
+*/
+
+// Mark a block found, returns TRUE if it was found before
+static bool_t mark_block(fsck_t *ck, int iblock){
+    int bit = (int) (1u << (iblock % 32));
+
+    if(atomic_fetch_or(&ck->seen[iblock/32], bit) & bit){
+        atomic_add(&ck->extra[iblock], 1);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// Returns TRUE if a block pointer is neither -1 nor a data block
+static bool_t bad_pointer(fsck_t *ck, int iblock){
+    if(iblock == -1 || (iblock >= 0 && iblock < ck->fs->super.num_data_blocks))
+        return FALSE;
+    atomic_add(&ck->check->bad_pointers, 1);
+    return TRUE;
+}
+
+// Mark the blocks of a tree of pointers blocks, height is 0 for a data
+// block. Bad pointers are cleared when repairing.
+static void mark_tree(fsck_t *ck, int iblock, int height){
+    mount_t *fs = ck->fs;
+    bool_t changed = FALSE;
+    DataBlock block;
+
+    // a shared subtree is walked once
+    if(mark_block(ck, iblock) || height == 0) return;
+
+    block_read(&fs->dev, fs->super.beg_data + iblock, (char *) &block);
+    for(int i = 0; i < fs->super.pointers_per_block; i++){
+        if(bad_pointer(ck, block.pointers[i])){
+            block.pointers[i] = -1;
+            changed = TRUE;
+        }else if(block.pointers[i] != -1){
+            mark_tree(ck, block.pointers[i], height-1);
+        }
+    }
+
+    if(changed && ck->repair)
+        block_write(&fs->dev, fs->super.beg_data + iblock, (char *) &block);
+}
+
+// Mark the blocks of an inode, returns TRUE if the inode must be saved
+static bool_t check_pointer(fsck_t *ck, int *iblock, int height){
+    if(bad_pointer(ck, *iblock)){
+        *iblock = -1;
+        return TRUE;
+    }
+    if(*iblock != -1) mark_tree(ck, *iblock, height);
+    return FALSE;
+}
+
+// Check an inode against what step 1 found
+static void check_inode(fsck_t *ck, int inum, inode_t *inode){
+    mount_t *fs = ck->fs;
+    bool_t allocated = IS_SET(fs->map.imap, inum), changed = FALSE;
+    int links;
+
+    if(!ck->live[inum]){
+        if(allocated) atomic_add(&ck->check->unreachable, 1);
+        return;
+    }
+    if(!allocated) atomic_add(&ck->check->bad_imap, 1);
+
+    for(int i = 0; i < fs->super.direct_pointers; i++){
+        changed |= check_pointer(ck, &inode->direct[i], 0);
+    }
+    changed |= check_pointer(ck, &inode->indirect1, 1);
+    changed |= check_pointer(ck, &inode->indirect2, 2);
+    changed |= check_pointer(ck, &inode->indirect3, 3);
+
+    // directories are not linked by the '..' of their subdirectories
+    links = (inode->type == DIRECTORY) ? 1 : ck->links[inum];
+    if(inode->link_counter != links){
+        atomic_add(&ck->check->bad_links, 1);
+        inode->link_counter = links;
+        changed = TRUE;
+    }
+
+    if(changed && ck->repair)
+        save_inode(fs, inum, *inode);
+}
+
+// Count the entries of a directory changed since the last checkpoint
+static void count_entries(fsck_t *ck, int dir, inode_t *inode){
+    mount_t *fs = ck->fs;
+    int ppd = fs->super.pointers_per_dcb;
+    int iblock, child;
+    inode_t child_inode;
+    DataBlock block;
+
+    for(int i = 0; i < inode->size; i++){
+        if(i % ppd == 0){
+            iblock = get_iblock(fs, *inode, i / ppd);
+            if(iblock < 0 || iblock >= fs->super.num_data_blocks) return;
+            block_read(&fs->dev, fs->super.beg_data + iblock, (char *) &block);
+        }
+        child = block.dir.files_inum[i % ppd];
+        if(i == 0){
+            if(child != dir) atomic_add(&ck->check->bad_entries, 1);
+            continue;
+        }
+
+        if(child >= 0 && child < fs->super.num_inodes && IS_SET(fs->map.imap, child)){
+            child_inode = get_inode_per_inum(fs, child);
+            if(child_inode.type == FILE_TYPE || child_inode.type == DIRECTORY){
+                // '..' does not link its directory
+                if(i > 1) atomic_add(&ck->links[child], 1);
+                continue;
+            }
+        }
+        atomic_add(&ck->check->bad_entries, 1);
+    }
+}
+
+// Check an inode of a block changed since the last checkpoint. Inodes
+// freed keep their type, only the ones in the map are looked at.
+static void check_dirty_inode(fsck_t *ck, int inum, inode_t *inode){
+    mount_t *fs = ck->fs;
+
+    if(!IS_SET(fs->map.imap, inum)) return;
+    if(inode->type != FILE_TYPE && inode->type != DIRECTORY){
+        atomic_add(&ck->check->bad_imap, 1);
+        return;
+    }
+
+    for(int i = 0; i < fs->super.direct_pointers; i++){
+        check_pointer(ck, &inode->direct[i], 0);
+    }
+    check_pointer(ck, &inode->indirect1, 1);
+    check_pointer(ck, &inode->indirect2, 2);
+    check_pointer(ck, &inode->indirect3, 3);
+
+    if(inode->type == DIRECTORY)
+        count_entries(ck, inum, inode);
+    else if(inode->link_counter == 0 && !ck->live[inum])
+        atomic_add(&ck->check->bad_links, 1); // neither linked nor an orphan
+}
+
+// Worker of step 2, takes ranges of the inode table until none is left
+static void *scan_inodes(void *arg){
+    fsck_t *ck = arg;
+    mount_t *fs = ck->fs;
+    int start, ipb = fs->super.inodes_per_block;
+    Block block;
+
+    while((start = atomic_add(&ck->next_range, FSCK_RANGE) - FSCK_RANGE) < fs->super.num_blocks_inodes){
+        for(int b = start; b < start + FSCK_RANGE && b < fs->super.num_blocks_inodes; b++){
+            if(ck->dirty_only && !is_itable_block_dirty(fs, b))
+                continue;
+
+            block_read(&fs->dev, fs->super.beg_inodes + b, (char *) &block);
+            for(int i = 0; i < ipb; i++){
+                if(ck->dirty_only)
+                    check_dirty_inode(ck, b * ipb + i, &block.inodes[i]);
+                else
+                    check_inode(ck, b * ipb + i, &block.inodes[i]);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Run step 2, on FSCK_WORKERS threads
+static void run_workers(fsck_t *ck){
+#ifdef FAKE
+    thread_t workers[FSCK_WORKERS];
+
+    for(int i = 0; i < FSCK_WORKERS; i++){
+        thread_create(&workers[i], scan_inodes, ck);
+    }
+    for(int i = 0; i < FSCK_WORKERS; i++){
+        thread_join(workers[i]);
+    }
+#else
+    scan_inodes(ck);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+/*
+    Step 3, the map of bits and the reference counts
+*/
+
+// Count the blocks pinned by fs_map_range, each range holds a reference
+// to its blocks as a clone would, see fs_map_range
+static void count_mapped(fsck_t *ck){
+    mount_t *fs = ck->fs;
+    int bit, held, inum;
+
+    // looking every block up in the cache is only worth it with ranges mapped
+    for(inum = 0; inum < fs->super.num_inodes && !is_inode_mapped(fs, inum); inum++);
+    if(inum == fs->super.num_inodes) return;
+
+    for(int i = 0; i < fs->super.num_data_blocks; i++){
+        held = block_pinned(&fs->dev, fs->super.beg_data + i);
+        if(held == 0) continue;
+
+        bit = (int) (1u << (i % 32));
+        if((ck->seen[i/32] & bit) == 0){
+            ck->seen[i/32] |= bit;
+            held--;
+        }
+        ck->extra[i] += held;
+    }
+}
+
+// Compare the map of bits with the live inodes and the blocks found
+static void check_map(fsck_t *ck){
+    mount_t *fs = ck->fs;
+    bool_t used;
+    int bit;
+
+    for(int i = 0; i < fs->super.num_inodes; i++){
+        if(ck->repair && ck->live[i] != IS_SET(fs->map.imap, i))
+            set_imap_bit(fs, i, ck->live[i]);
+    }
+
+    for(int i = 0; i < fs->super.num_data_blocks; i++){
+        bit = (int) (1u << (i % 32));
+        used = (ck->seen[i/32] & bit) != 0;
+        if(used == IS_SET(fs->map.dmap, i)) continue;
+
+        atomic_add(&ck->check->bad_dmap, 1);
+        if(ck->repair)
+            set_dmap_bit(fs, i, used);
+    }
+}
+
+// Compare the reference counts table with the extra references found,
+// returns the number of shared blocks
+static int check_refs(fsck_t *ck){
+    mount_t *fs = ck->fs;
+    int shared = 0, refs;
+    bool_t changed = FALSE;
+    Block block;
+
+    for(int i = 0; i < fs->super.num_data_blocks; i++){
+        if(i % REFS_PER_BLOCK == 0)
+            block_read(&fs->dev, fs->super.beg_refcount + i / REFS_PER_BLOCK, (char *) &block);
+
+        refs = ck->extra[i];
+        shared += (refs > 0);
+        if(block.refs[i % REFS_PER_BLOCK] != refs){
+            atomic_add(&ck->check->bad_refs, 1);
+            block.refs[i % REFS_PER_BLOCK] = refs;
+            changed = TRUE;
+        }
+
+        if(changed && ck->repair && ((i+1) % REFS_PER_BLOCK == 0 || i+1 == fs->super.num_data_blocks)){
+            block_write(&fs->dev, fs->super.beg_refcount + i / REFS_PER_BLOCK, (char *) &block);
+            changed = FALSE;
+        }
+    }
+    return shared;
+}
+
+// Check the blocks found in the inodes changed since the last checkpoint
+// against the map of bits and the reference counts, and their entries
+// against the link counts
+static void check_dirty_found(fsck_t *ck){
+    mount_t *fs = ck->fs;
+    inode_t inode;
+    int bit;
+
+    for(int i = 0; i < fs->super.num_data_blocks; i++){
+        bit = (int) (1u << (i % 32));
+        if(ck->seen[i/32] == 0){
+            i += 31 - i % 32;
+            continue;
+        }
+        if((ck->seen[i/32] & bit) == 0) continue;
+
+        if(!IS_SET(fs->map.dmap, i))
+            atomic_add(&ck->check->bad_dmap, 1);
+        // only some of the references were found
+        if(ck->extra[i] > get_iblock_refs(fs, i))
+            atomic_add(&ck->check->bad_refs, 1);
+    }
+
+    for(int i = 0; i < fs->super.num_inodes; i++){
+        if(ck->links[i] == 0) continue;
+
+        inode = get_inode_per_inum(fs, i);
+        if(inode.type == DIRECTORY && ck->links[i] > 1)
+            atomic_add(&ck->check->bad_entries, ck->links[i] - 1);
+        else if(inode.type == FILE_TYPE && inode.link_counter != ck->links[i])
+            atomic_add(&ck->check->bad_links, 1);
+    }
+}
+
+// Check the inodes changed since the last checkpoint
+static void check_dirty(fsck_t *ck){
+    mount_t *fs = ck->fs;
+    int inum;
+
+    ck->dirty_only = TRUE;
+    for(int i = 0; i < (int) fs->super.num_orphans; i++){
+        inum = fs->super.orphans[i];
+        if(inum >= 0 && inum < fs->super.num_inodes)
+            ck->live[inum] = TRUE;
+    }
+
+    run_workers(ck);
+    check_dirty_found(ck);
+}
+
+// Check the whole file system, returns -1 if there is no root directory
+static int check_all(fsck_t *ck){
+    mount_t *fs = ck->fs;
+    int shared;
+
+    // repairs may write any block of the inode table
+    if(ck->repair){
+        for(int i = 0; i < DIRTY_ITABLE_BITS/32; i++){
+            fs->super.dirty_itable[i] = -1;
+        }
+        sync_superblock(fs);
+    }
+
+    if(walk_tree(ck) < 0) return -1;
+    run_workers(ck);
+    count_mapped(ck);
+
+    // repairs may have freed blocks of directories
+    apply_free_list(fs);
+    check_map(ck);
+    shared = check_refs(ck);
+
+    if(ck->repair){
+        fs->shared_blocks = shared;
+        save_map(fs);
+        dcache_forget(fs, -1);
+    }
+    return 0;
+}
+
+// Frees the tables of a check
+static void fsck_release(fsck_t *ck){
+    fs_free(ck->live);
+    fs_free(ck->links);
+    fs_free(ck->queue);
+    fs_free(ck->parent);
+    fs_free(ck->seen);
+    fs_free(ck->extra);
+}
+
+// Sets up a check of a file system, with its tables cleared. Returns -1 if
+// there is no memory for them.
+static int fsck_alloc(fsck_t *ck, mount_t *fs, fsCheck *buf){
+    ulong_t ninodes = fs->super.num_inodes, nblocks = fs->super.num_data_blocks;
+
+    bzero((char *) ck, sizeof(fsck_t));
+    ck->fs = fs;
+    ck->check = buf;
+    ck->live = fs_alloc(ninodes);
+    ck->links = fs_alloc(ninodes * sizeof(int));
+    ck->queue = fs_alloc(ninodes * sizeof(int));
+    ck->parent = fs_alloc(ninodes * sizeof(int));
+    ck->seen = fs_alloc((nblocks + 31) / 32 * sizeof(int));
+    ck->extra = fs_alloc(nblocks * sizeof(uint16_t));
+    if(ck->live == NULL || ck->links == NULL || ck->queue == NULL || ck->parent == NULL ||
+       ck->seen == NULL || ck->extra == NULL){
+        fsck_release(ck);
+        return -1;
+    }
+    return 0;
+}
+
+// Adds up the inconsistencies found
+static int count_errors(fsCheck *buf){
+    return buf->bad_imap + buf->bad_dmap + buf->bad_refs + buf->bad_links +
+           buf->bad_pointers + buf->bad_entries + buf->unreachable;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+/*
+    Checks the file system of a session, and repairs it if FS_FSCK_REPAIR
+    is given. The counters of buf tell what was wrong, and its map is the
+    map of bits once the check is done, repaired or not. A check finding
+    nothing wrong, or repairing it, is a checkpoint.
+*/
+int fs_fsck(fs_t *session, fsCheck *buf, int options){
+    mount_t *fs = session->mount;
+    fsck_t *ck = &fsck_state;
+    bool_t dirty;
+    int ret = 0;
+
+    *buf = (fsCheck) {.magic_number = fs->super.magic_number};
+
+    flush_all_fds(fs);
+    mutex_lock(&fsck_lock);
+    lock_all_inodes(fs);
+    mutex_lock(&fs->alloc_lock);
+    apply_free_list(fs);
+
+    if(fsck_alloc(ck, fs, buf) < 0){
+        ret = -1;
+        goto unlock;
+    }
+    dirty = is_itable_dirty(fs);
+
+    if(options & FS_FSCK_DIRTY){
+        if(dirty) check_dirty(ck);
+        buf->errors = count_errors(buf);
+        if(buf->errors == 0 || !(options & FS_FSCK_REPAIR)) goto out;
+
+        // something is wrong, look at everything
+        *buf = (fsCheck) {.magic_number = fs->super.magic_number};
+        fsck_release(ck);
+        if(fsck_alloc(ck, fs, buf) < 0){
+            ret = -1;
+            goto unlock;
+        }
+    }
+
+    ck->repair = (options & FS_FSCK_REPAIR) != 0;
+    ret = check_all(ck);
+    buf->errors = count_errors(buf);
+
+out:
+    if(ret == 0 && (dirty || ck->repair) && (buf->errors == 0 || ck->repair))
+        checkpoint(fs);
+
+    fsck_release(ck);
+
+unlock:
+    buf->inodes_allocated = inodes_used(fs);
+    buf->blocks_allocated = blocks_used(fs);
+    buf->map = fs->map;
+
+    mutex_unlock(&fs->alloc_lock);
+    unlock_all_inodes(fs);
+    mutex_unlock(&fsck_lock);
+
+    if(ret == 0 && (options & FS_FSCK_REPAIR)) commit_op(fs);
+    return ret;
+}
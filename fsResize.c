@@ -0,0 +1,380 @@
+/*  fsResize.c
+
+    Growing and shrinking a mounted file system. The data blocks come
+    before the tables they size, the blocks map and the reference counts
+    table, see set_geometry, so resizing the image moves the tables and
+    leaves the data where it is. The inode table keeps its size, the number
+    of inodes is chosen when formatting.
+
+    Growing is done online, with files open. The image is extended, the
+    tables are written at their new place, past the old end of the image,
+    and the superblock written through to the device switches to them, so
+    a crash before that leaves the file system as it was. The blocks of the
+    old tables become free data blocks. It costs the writing of the tables.
+
+    Shrinking is done offline, with no file open. The blocks in use past the
+    new end of the data area are moved below it, and the pointers to them
+    rewritten, walking the block tree of every inode in use. Blocks shared
+    by clones are moved once, along with their reference count. Then the
+    tables are written at their new place and the image is truncated. Only
+    the data of the tail is copied. Every block of the inode table is
+    recorded as changed beforehand, so a crash halfway through is repaired
+    when the file system is next mounted.
+*/
+
+#include "util.h"
+#include "common.h"
+#include "block.h"
+#include "fs.h"
+#include "fsUtil.h"
+#include "lock.h"
+
+// Blocks moved by a shrink, the new place of each block of the tail
+typedef struct{
+    mount_t *fs;
+    int data; // data blocks kept, the tail starts there
+    int *moved; // new place of each block of the tail, -1 until it is moved
+    bool_t failed; // a block could not be moved, the shrink is given up
+} shrink_t;
+
+#define MAP_IS_SET(map, i) (((map)[(i)/8] & (1<<(7-(i)%8))) != 0)
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+/*
+    The tables
+*/
+
+// Allocates the blocks map of the geometry of sb and the bits of its blocks
+// changed, before anything is changed. Returns -1 if there is no memory.
+static int alloc_dmap(mount_t *fs, superblock_t *sb, char **dmap, char **changed){
+    *dmap = fs_alloc((ulong_t) sb->num_dmap_blocks * BLOCK_SIZE);
+    *changed = fs_alloc((fs->super.num_imap_blocks + sb->num_dmap_blocks + 7) / 8);
+    if(*dmap == NULL || *changed == NULL){
+        fs_free(*dmap);
+        fs_free(*changed);
+        return -1;
+    }
+    return 0;
+}
+
+// Switches to the blocks map allocated by alloc_dmap, keeping the bits of
+// the blocks below sb->num_data_blocks. Its blocks are left as not changed,
+// the caller writes them all.
+static void resize_dmap(mount_t *fs, superblock_t *sb, char *dmap, char *changed){
+    int nimap = fs->super.num_imap_blocks, nbits = sb->num_data_blocks;
+    ulong_t bytes = (ulong_t) sb->num_dmap_blocks * BLOCK_SIZE;
+    ulong_t kept = (ulong_t) fs->super.num_dmap_blocks * BLOCK_SIZE;
+
+    bcopy((unsigned char *) fs->map.dmap, (unsigned char *) dmap, (kept < bytes) ? kept : bytes);
+
+    // bits of the blocks dropped by a shrink
+    if(nbits % 8 != 0)
+        dmap[nbits/8] &= (char) (0xFF << (8 - nbits % 8));
+    bzero(dmap + (nbits + 7) / 8, bytes - (nbits + 7) / 8);
+
+    // the inodes map stays, and so do its blocks changed
+    for(int b = 0; b < nimap; b++){
+        if(MAP_IS_SET(fs->map_changed, b))
+            changed[b/8] |= (1<<(7-b%8));
+    }
+
+    fs_free(fs->map.dmap);
+    fs_free(fs->map_changed);
+    fs->map.dmap = dmap;
+    fs->map_changed = changed;
+    if(fs->block_hint > nbits) fs->block_hint = nbits;
+}
+
+// Returns TRUE if a block holds nothing but zeros
+static bool_t is_zero_block(char *data){
+    for(int i = 0; i < BLOCK_SIZE; i++){
+        if(data[i] != 0) return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+    Writes the tables of the geometry of sb at their place, from the map in
+    memory and the reference counts table at the place given by old. The
+    table moves down on a shrink and up on a grow, block by block in
+    increasing order, so none is overwritten before it is read. Blocks
+    written past the old end of the image are holes reading as zeros, the
+    ones of nothing but zeros are skipped.
+*/
+static void write_tables(mount_t *fs, superblock_t *sb, superblock_t *old){
+    Block block;
+
+    for(int b = 0; b < (int) sb->num_refcount_blocks; b++){
+        bzero((char *) &block, BLOCK_SIZE);
+        if(fs->shared_blocks > 0 && b < (int) old->num_refcount_blocks)
+            block_read(&fs->dev, old->beg_refcount + b, (char *) &block);
+
+        // entries of blocks dropped by a shrink
+        for(int i = 0; i < REFS_PER_BLOCK; i++){
+            if(b * REFS_PER_BLOCK + i >= (int) sb->num_data_blocks)
+                block.refs[i] = 0;
+        }
+
+        if(sb->beg_refcount + b < old->size_disk || !is_zero_block((char *) &block))
+            block_write(&fs->dev, sb->beg_refcount + b, (char *) &block);
+    }
+
+    for(int b = 0; b < (int) sb->num_dmap_blocks; b++){
+        if(sb->beg_dmap + b < old->size_disk || !is_zero_block(fs->map.dmap + b * BLOCK_SIZE))
+            block_write(&fs->dev, sb->beg_dmap + b, fs->map.dmap + b * BLOCK_SIZE);
+    }
+}
+
+// Switches to the tables written, once they are on the device
+static void switch_tables(mount_t *fs, superblock_t *sb){
+    sync_device(fs, FALSE);
+    fs->super.size_disk = sb->size_disk;
+    fs->super.num_data_blocks = sb->num_data_blocks;
+    fs->super.num_dmap_blocks = sb->num_dmap_blocks;
+    fs->super.num_refcount_blocks = sb->num_refcount_blocks;
+    fs->super.beg_dmap = sb->beg_dmap;
+    fs->super.beg_refcount = sb->beg_refcount;
+    sync_superblock(fs);
+    sync_device(fs, FALSE);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+/*
+    Growing
+*/
+
+// Grows the file system to the geometry of sb, returns -1 if its tables
+// would overwrite the old ones, or if there is no memory for them
+static int grow(mount_t *fs, superblock_t *sb){
+    superblock_t old = fs->super;
+    char *dmap, *changed;
+
+    if(sb->beg_dmap != old.beg_dmap && sb->beg_dmap < old.size_disk) return -1;
+    if(alloc_dmap(fs, sb, &dmap, &changed) < 0) return -1;
+    resize_dmap(fs, sb, dmap, changed);
+
+    block_truncate(&fs->dev, sb->size_disk);
+    write_tables(fs, sb, &old);
+    switch_tables(fs, sb);
+
+    // the old tables are free data blocks now
+    if(fs->discard && sb->beg_dmap != old.beg_dmap)
+        block_discard(&fs->dev, old.beg_dmap, old.size_disk - old.beg_dmap);
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+/*
+    Shrinking
+*/
+
+// Moves a block of the tail below it, once, and returns its new place. If
+// no block is free below the tail, it is left in place and the shrink is
+// given up, the blocks moved until then are still returned.
+static int move_block(shrink_t *sh, int iblock){
+    mount_t *fs = sh->fs;
+    int *to = &sh->moved[iblock - sh->data];
+    int refs, free_block;
+    Block block;
+
+    if(*to >= 0) return *to;
+    if(sh->failed) return iblock;
+
+    // there is room below the tail, it was counted beforehand
+    free_block = get_single_available_iblock(fs);
+    if(free_block < 0 || free_block >= sh->data){
+        if(free_block >= 0) free_iblock(fs, free_block);
+        sh->failed = TRUE;
+        return iblock;
+    }
+    *to = free_block;
+    block_read(&fs->dev, fs->super.beg_data + iblock, (char *) &block);
+    block_write(&fs->dev, fs->super.beg_data + *to, (char *) &block);
+
+    refs = get_iblock_refs(fs, iblock);
+    if(refs > 0) set_iblock_refs(fs, *to, refs);
+    return *to;
+}
+
+// Moves the blocks of a tree of pointers blocks out of the tail, height is
+// 0 for a data block. Returns the new place of the tree.
+static int shrink_tree(shrink_t *sh, int iblock, int height){
+    mount_t *fs = sh->fs;
+    bool_t changed = FALSE;
+    DataBlock block;
+    int to;
+
+    // bad pointers are left to fs_fsck
+    if(iblock < 0 || iblock >= fs->super.num_data_blocks) return iblock;
+
+    if(iblock >= sh->data) iblock = move_block(sh, iblock);
+    if(height == 0) return iblock;
+
+    block_read(&fs->dev, fs->super.beg_data + iblock, (char *) &block);
+    for(int i = 0; i < fs->super.pointers_per_block; i++){
+        if(block.pointers[i] == -1) continue;
+        to = shrink_tree(sh, block.pointers[i], height-1);
+        if(to != block.pointers[i]){
+            block.pointers[i] = to;
+            changed = TRUE;
+        }
+    }
+
+    if(changed)
+        block_write(&fs->dev, fs->super.beg_data + iblock, (char *) &block);
+    return iblock;
+}
+
+// Moves the blocks of a pointer of an inode, returns TRUE if it changed
+static bool_t shrink_pointer(shrink_t *sh, int *iblock, int height){
+    int to;
+
+    if(*iblock == -1) return FALSE;
+    to = shrink_tree(sh, *iblock, height);
+    if(to == *iblock) return FALSE;
+    *iblock = to;
+    return TRUE;
+}
+
+// Moves the blocks of an inode out of the tail
+static void shrink_inode(shrink_t *sh, int inum){
+    mount_t *fs = sh->fs;
+    inode_t inode = get_inode_per_inum(fs, inum);
+    bool_t changed = FALSE;
+
+    for(int i = 0; i < fs->super.direct_pointers; i++){
+        changed |= shrink_pointer(sh, &inode.direct[i], 0);
+    }
+    changed |= shrink_pointer(sh, &inode.indirect1, 1);
+    changed |= shrink_pointer(sh, &inode.indirect2, 2);
+    changed |= shrink_pointer(sh, &inode.indirect3, 3);
+
+    if(changed) save_inode(fs, inum, inode);
+}
+
+// Returns TRUE if a descriptor is open or a range mapped on the file system
+static bool_t any_file_in_use(mount_t *fs){
+    for(int fd = 0; fd < fs->fd_nchunks * FD_CHUNK; fd++){
+        if(get_fd(fs, fd) != NULL) return TRUE;
+    }
+    for(int i = 0; i < (int) fs->super.num_inodes; i++){
+        if(is_inode_mapped(fs, i)) return TRUE;
+    }
+    return FALSE;
+}
+
+// Gives up a shrink once every pointer to the blocks moved is rewritten,
+// they keep their new place and the ones of the tail they were copied from
+// are freed
+static void undo_shrink(shrink_t *sh, int tail){
+    mount_t *fs = sh->fs;
+
+    for(int i = 0; i < tail; i++){
+        if(sh->moved[i] < 0) continue;
+        if(get_iblock_refs(fs, sh->data + i) > 0)
+            set_iblock_refs(fs, sh->data + i, 0);
+        set_dmap_bit(fs, sh->data + i, FALSE);
+    }
+    save_map(fs);
+}
+
+// Shrinks the file system to the geometry of sb, returns -1 if a file is
+// open or mapped, if the blocks in use do not fit, or if there is no memory
+static int shrink(mount_t *fs, superblock_t *sb){
+    superblock_t old = fs->super;
+    int tail = old.num_data_blocks - sb->num_data_blocks;
+    shrink_t sh = {.fs = fs, .data = sb->num_data_blocks, .failed = FALSE};
+    char *dmap, *changed;
+
+    if(any_file_in_use(fs) || blocks_used(fs) > sh.data) return -1;
+
+    // nothing can fail for lack of memory once blocks are moved
+    if(alloc_dmap(fs, sb, &dmap, &changed) < 0) return -1;
+    sh.moved = fs_alloc((ulong_t) tail * sizeof(int));
+    if(sh.moved == NULL){
+        fs_free(dmap);
+        fs_free(changed);
+        return -1;
+    }
+    for(int i = 0; i < tail; i++){
+        sh.moved[i] = -1;
+    }
+
+    // a crash from now on is repaired at mount
+    for(int i = 0; i < DIRTY_ITABLE_BITS/32; i++){
+        fs->super.dirty_itable[i] = -1;
+    }
+    sync_superblock(fs);
+
+    // allocation takes the lowest blocks free, all of them below the tail.
+    // Once given up, the walk goes on so every pointer to a block moved is
+    // rewritten, blocks shared by clones included.
+    for(int i = 0; i < (int) fs->super.num_inodes; i++){
+        if(i % 8 == 0 && fs->map.imap[i/8] == 0){
+            i += 7;
+            continue;
+        }
+        if(MAP_IS_SET(fs->map.imap, i))
+            shrink_inode(&sh, i);
+    }
+
+    if(sh.failed){
+        undo_shrink(&sh, tail);
+        fs_free(sh.moved);
+        fs_free(dmap);
+        fs_free(changed);
+        checkpoint(fs);
+        return -1;
+    }
+    fs_free(sh.moved);
+
+    // the blocks moved must be on the device before the tables are written
+    // over the tail they were copied from
+    sync_device(fs, FALSE);
+
+    resize_dmap(fs, sb, dmap, changed);
+    write_tables(fs, sb, &old);
+    switch_tables(fs, sb);
+    block_truncate(&fs->dev, sb->size_disk);
+    checkpoint(fs);
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+/*
+    Resizes the file system of a session to size bytes, keeping its number
+    of inodes. Growing is done with files open or mapped, shrinking only
+    with none. Returns -1 if the inode table does not fit in the new
+    size, or if the blocks in use do not. A grow must make room for the
+    tables past the old end of the image, about a 256th of the new size,
+    otherwise it returns -1 too.
+*/
+int fs_resize(fs_t *session, fs_off_t size){
+    mount_t *fs = session->mount;
+    fs_off_t nblocks = size / BLOCK_SIZE;
+    superblock_t sb;
+    int ret;
+
+    if(nblocks <= 0 || nblocks > MAX_BLOCKS) return -1;
+
+    flush_all_fds(fs);
+    lock_all_inodes(fs);
+    mutex_lock(&fs->alloc_lock);
+    apply_free_list(fs);
+
+    sb = fs->super;
+    if(set_geometry(&sb, nblocks, fs->super.num_inodes) < 0)
+        ret = -1;
+    else if(sb.num_data_blocks >= fs->super.num_data_blocks)
+        ret = grow(fs, &sb);
+    else
+        ret = shrink(fs, &sb);
+
+    mutex_unlock(&fs->alloc_lock);
+    unlock_all_inodes(fs);
+    return ret;
+}
@@ -3,16 +3,16 @@
 #include "util.h"
 #include "fsUtil.h"
 #include "common.h"
+#include "lock.h"
 
 #include <assert.h>
 #include <stdio.h>
 
-// Declaring the global variables
-extern superblock_t super;
-extern bmap_t map;
-extern dir_t current_dir;
+#ifdef FAKE
+#include <stdlib.h>
+#endif
 
-extern FileDescriptor table[MAX_OPEN_FILES];
+extern char zero_block[BLOCK_SIZE];
 
 /////////////////////////////////////////////////////////////////////////////////////
 
@@ -22,234 +22,703 @@ extern FileDescriptor table[MAX_OPEN_FILES];
 
 // Returns the pointer to a block given its relative index on
 // indirect blocks pointer
-int get_indirect_iblock(uint32_t iblock, int height, int index){
+int get_indirect_iblock(mount_t *fs, uint32_t iblock, int height, int index){
 
     DataBlock block;
-    block_read(super.beg_data + iblock, (char *) &block);
+    block_read(&fs->dev, fs->super.beg_data + iblock, (char *) &block);
     if(height == 1){
         return block.pointers[index];
     }
 
     int blocks_per_pointer = 1, i;
     for(i = 1; i < height; i++){
-        blocks_per_pointer *= super.pointers_per_block;
+        blocks_per_pointer *= fs->super.pointers_per_block;
     }
 
-    for(i = 0; i < super.pointers_per_block; i++){
-        if(block.pointers[i] == -1)
-            return -1;
-        if(index < blocks_per_pointer){
-            return get_indirect_iblock(block.pointers[i], 
-                                       height-1, index);
-        }
-        index -= blocks_per_pointer;
-    }
-    
-    return -1;
+    // pointers blocks may have holes, go straight to the right child
+    i = index / blocks_per_pointer;
+    if(block.pointers[i] == -1)
+        return -1;
+    return get_indirect_iblock(fs, block.pointers[i], height-1,
+                               index % blocks_per_pointer);
 }
 
 // This function returns the ith block of an inode
-int get_iblock(inode_t file, int index){
-    if(index >= max_blocks_of_file()){
+int get_iblock(mount_t *fs, inode_t file, int index){
+    if(index >= max_blocks_of_file(fs)){
         return -1;
     }
 
-    if(index < super.direct_pointers){
+    if(index < fs->super.direct_pointers){
         return file.direct[index];
     }
-    index -= super.direct_pointers;
+    index -= fs->super.direct_pointers;
 
     // trying the first set of indirect blocks
-    if(index < super.pointers_per_block){
+    if(index < fs->super.pointers_per_block){
         if(file.indirect1 == -1) return -1;
-        return get_indirect_iblock(file.indirect1, 1, index);
+        return get_indirect_iblock(fs, file.indirect1, 1, index);
     }
-    index -= super.pointers_per_block;
+    index -= fs->super.pointers_per_block;
 
     // if not found, try the double indirect blocks
-    if(index < super.pointers_per_block*super.pointers_per_block){
+    if(index < fs->super.pointers_per_block*fs->super.pointers_per_block){
         if(file.indirect2 == -1) return -1;
-        return get_indirect_iblock(file.indirect2, 2, index);
+        return get_indirect_iblock(fs, file.indirect2, 2, index);
     }
-    index -= super.pointers_per_block*super.pointers_per_block;
+    index -= fs->super.pointers_per_block*fs->super.pointers_per_block;
 
     if(file.indirect3 == -1) return -1;
-    return get_indirect_iblock(file.indirect3, 3, index);
+    return get_indirect_iblock(fs, file.indirect3, 3, index);
 }
 
-// Set the pointer to a block given its relative index on
-// indirect blocks pointer, returns 1 if successfuly
-int set_indirect_iblock(uint32_t iblock, int height, int index, int new_inum){
-    
+// Copies count consecutive pointers, starting at relative index, from the
+// tree rooted at the given pointers block. Every block is read only once.
+void get_indirect_iblock_run(mount_t *fs, int iblock, int height, int index, int count, int *out){
+    int i;
+
+    if(iblock == -1){
+        for(i = 0; i < count; i++) out[i] = -1;
+        return;
+    }
+
     DataBlock block;
-    block_read(super.beg_data + iblock, (char *) &block);
+    block_read(&fs->dev, fs->super.beg_data + iblock, (char *) &block);
     if(height == 1){
-        if(index >= super.pointers_per_block) return -1;
-        block.pointers[index] = new_inum;
-        block_write(super.beg_data + iblock, (char *) &block);
-        return 0;
+        for(i = 0; i < count; i++) out[i] = block.pointers[index+i];
+        return;
     }
 
-    int blocks_per_pointer = 1, i, ret;
+    int blocks_per_pointer = 1;
     for(i = 1; i < height; i++){
-        blocks_per_pointer *= super.pointers_per_block;
+        blocks_per_pointer *= fs->super.pointers_per_block;
     }
 
-    for(i = 0; i < super.pointers_per_block; i++){
-        if(index < blocks_per_pointer){
-            if(block.pointers[i] == -1){
-                // allocate new block of pointers
-                int new_iblock = get_single_available_iblock();
-                if(new_iblock < 0) return -1;
+    while(count > 0){
+        int child = index / blocks_per_pointer;
+        int rel = index % blocks_per_pointer;
+        int n = blocks_per_pointer - rel;
+        if(n > count) n = count;
 
-                DataBlock aux_block;
-                for(int i = 0; i < super.pointers_per_block; i++)
-                    aux_block.pointers[i] = -1;
-                block_write(super.beg_data + new_iblock, (char *) &aux_block);
+        get_indirect_iblock_run(fs, block.pointers[child], height-1, rel, n, out);
+        out += n;
+        index += n;
+        count -= n;
+    }
+}
 
-                block.pointers[i] = new_iblock;
-                block_write(super.beg_data + iblock, (char *) &block);
-            }
+// Same as get_iblock, but resolves count consecutive blocks of an inode at
+// once, so each pointers block on the path is read a single time.
+// Blocks that are not mapped are returned as -1.
+void get_iblock_run(mount_t *fs, inode_t file, int index, int count, int *out){
+    int ppb = fs->super.pointers_per_block;
+    int region_start[3] = {fs->super.direct_pointers,
+                           fs->super.direct_pointers + ppb,
+                           fs->super.direct_pointers + ppb + ppb*ppb};
+    int region_size[3] = {ppb, ppb*ppb, ppb*ppb*ppb};
+    int region_root[3] = {file.indirect1, file.indirect2, file.indirect3};
+
+    // direct pointers
+    while(count > 0 && index < fs->super.direct_pointers){
+        *out++ = file.direct[index++];
+        count--;
+    }
 
-            ret = set_indirect_iblock(block.pointers[i], height-1, index, new_inum);
-            if(is_pointers_block_empty(block.pointers[i])){
-                free_iblock(block.pointers[i]);
-                block.pointers[i] = -1;
-            }
-            if(ret == 0) return 0;
-        }
-        index -= blocks_per_pointer;
+    // indirect pointers, one region per height
+    for(int h = 0; h < 3 && count > 0; h++){
+        int rel = index - region_start[h];
+        if(rel >= region_size[h]) continue;
+
+        int n = region_size[h] - rel;
+        if(n > count) n = count;
+
+        get_indirect_iblock_run(fs, region_root[h], h+1, rel, n, out);
+        out += n;
+        index += n;
+        count -= n;
     }
 
-    return -1;
+    // beyond the maximum size of a file
+    while(count-- > 0) *out++ = -1;
 }
-    
-int set_iblock(inode_t *file, int index, int new_inum){
-    if(index >= max_blocks_of_file()){
-        return -1;
+
+// Maps count consecutive pointers, starting at relative index, on the tree
+// rooted at *iblock. Missing pointers blocks are allocated on the way and
+// every block of the path is read and written only once. Shared pointers
+// blocks on the path are copied first, so the change is private to the file.
+// If in is NULL no pointer is changed, the path is only made private.
+int set_indirect_iblock_run(mount_t *fs, int *iblock, int height, int index, int count, int *in){
+    DataBlock block;
+    int i, ret = 0;
+    bool_t dirty = (in != NULL);
+
+    if(*iblock == -1){
+        if(in == NULL) return 0;
+
+        // allocate new block of pointers
+        int new_iblock = get_single_available_iblock(fs);
+        if(new_iblock < 0) return -1;
+
+        for(i = 0; i < fs->super.pointers_per_block; i++)
+            block.pointers[i] = -1;
+        *iblock = new_iblock;
+    }else{
+        if(get_iblock_refs(fs, *iblock) > 0){
+            int new_iblock = cow_pointers_block(fs, *iblock);
+            if(new_iblock < 0) return -1;
+            *iblock = new_iblock;
+        }
+        block_read(&fs->dev, fs->super.beg_data + *iblock, (char *) &block);
+    }
+
+    if(height == 1){
+        for(i = 0; i < count && in != NULL; i++) block.pointers[index+i] = in[i];
+    }else{
+        int blocks_per_pointer = 1;
+        for(i = 1; i < height; i++){
+            blocks_per_pointer *= fs->super.pointers_per_block;
+        }
+
+        while(count > 0 && ret == 0){
+            int child = index / blocks_per_pointer;
+            int rel = index % blocks_per_pointer;
+            int n = blocks_per_pointer - rel;
+            if(n > count) n = count;
+
+            int old_child = block.pointers[child];
+            ret = set_indirect_iblock_run(fs, &block.pointers[child], height-1, rel, n, in);
+            dirty |= (block.pointers[child] != old_child);
+            if(in != NULL) in += n;
+            index += n;
+            count -= n;
+        }
     }
 
-    int ppb = super.pointers_per_block, ret;
+    if(dirty){
+        block_write(&fs->dev, fs->super.beg_data + *iblock, (char *) &block);
+    }
+    return ret;
+}
 
-    // check if the file is in direct pointers
-    if(index < super.direct_pointers){
-        file->direct[index] = new_inum;
-        return 0;
+// Same as set_iblock, but maps count consecutive blocks of an inode at once.
+// It is meant to map new blocks, empty pointers blocks are not released.
+// If in is NULL, shared pointers blocks of the range are only made private.
+int set_iblock_run(mount_t *fs, inode_t *file, int index, int count, int *in){
+    int ppb = fs->super.pointers_per_block;
+    int region_start[3] = {fs->super.direct_pointers,
+                           fs->super.direct_pointers + ppb,
+                           fs->super.direct_pointers + ppb + ppb*ppb};
+    int region_size[3] = {ppb, ppb*ppb, ppb*ppb*ppb};
+    int *region_root[3] = {&file->indirect1, &file->indirect2, &file->indirect3};
+
+    // direct pointers
+    while(count > 0 && index < fs->super.direct_pointers){
+        if(in != NULL) file->direct[index] = *in++;
+        index++;
+        count--;
     }
-    index -= super.direct_pointers;
 
-    // check if the file is in simple indirect pointers
-    if(index < ppb){
-        if(file->indirect1 == -1){
-            // allocate new block of pointers
-            int iblock = get_single_available_iblock();
-            if(iblock < 0) return -1;
+    // indirect pointers, one region per height
+    for(int h = 0; h < 3 && count > 0; h++){
+        int rel = index - region_start[h];
+        if(rel >= region_size[h]) continue;
 
-            DataBlock block;
-            for(int i = 0; i < ppb; i++)
-                block.pointers[i] = -1;
-            block_write(super.beg_data + iblock, (char *) &block);
+        int n = region_size[h] - rel;
+        if(n > count) n = count;
 
-            file->indirect1 = iblock;
+        if(set_indirect_iblock_run(fs, region_root[h], h+1, rel, n, in) < 0){
+            return -1;
         }
-        ret = set_indirect_iblock(file->indirect1, 1, index, new_inum);
-        if(is_pointers_block_empty(file->indirect1)){
-            free_iblock(file->indirect1);
-            file->indirect1 = -1;
+        if(in != NULL) in += n;
+        index += n;
+        count -= n;
+    }
+
+    return (count > 0) ? -1 : 0;
+}
+
+// Unmaps count consecutive pointers, starting at relative index, on the tree
+// rooted at *iblock and frees the blocks they pointed to. Pointers blocks
+// left empty are freed too, in which case *iblock is set to -1. Returns -1
+// if a shared pointers block could not be copied, the pointers before it
+// are cleared then.
+int clear_indirect_iblock_run(mount_t *fs, int *iblock, int height, int index, int count){
+    DataBlock block;
+    int i, span = 1, ret = 0;
+
+    if(*iblock == -1) return 0;
+
+    for(i = 0; i < height; i++){
+        span *= fs->super.pointers_per_block;
+    }
+
+    if(get_iblock_refs(fs, *iblock) > 0){
+        if(index == 0 && count == span){
+            // the whole shared tree goes away, just drop our reference
+            free_iblock(fs, *iblock);
+            *iblock = -1;
+            return 0;
         }
-        return ret;
+
+        // only part of it is cleared, we need our own copy
+        int new_iblock = cow_pointers_block(fs, *iblock);
+        if(new_iblock < 0) return -1;
+        *iblock = new_iblock;
     }
-    index -= ppb;
 
-    // check if the file is in double indirect pointers
-    if(index < ppb*ppb){
-        if(file->indirect2 == -1){
-            // allocate new block of pointers
-            int iblock = get_single_available_iblock();
-            if(iblock < 0) return -1;
+    block_read(&fs->dev, fs->super.beg_data + *iblock, (char *) &block);
+    if(height == 1){
+        for(i = 0; i < count; i++){
+            if(block.pointers[index+i] != -1){
+                free_iblock(fs, block.pointers[index+i]);
+                block.pointers[index+i] = -1;
+            }
+        }
+    }else{
+        int blocks_per_pointer = 1;
+        for(i = 1; i < height; i++){
+            blocks_per_pointer *= fs->super.pointers_per_block;
+        }
 
-            DataBlock block;
-            for(int i = 0; i < ppb; i++)
-                block.pointers[i] = -1;
-            block_write(super.beg_data + iblock, (char *) &block);
+        // the pointers changed so far are written even if a child fails
+        while(count > 0 && ret == 0){
+            int child = index / blocks_per_pointer;
+            int rel = index % blocks_per_pointer;
+            int n = blocks_per_pointer - rel;
+            if(n > count) n = count;
 
-            file->indirect2 = iblock;
+            ret = clear_indirect_iblock_run(fs, &block.pointers[child], height-1, rel, n);
+            index += n;
+            count -= n;
         }
-        ret = set_indirect_iblock(file->indirect2, 2, index, new_inum);
-        if(is_pointers_block_empty(file->indirect2)){
-            free_iblock(file->indirect2);
-            file->indirect2 = -1;
+    }
+
+    for(i = 0; i < fs->super.pointers_per_block && block.pointers[i] == -1; i++);
+    if(i == fs->super.pointers_per_block){
+        free_iblock(fs, *iblock);
+        *iblock = -1;
+    }else{
+        block_write(&fs->dev, fs->super.beg_data + *iblock, (char *) &block);
+    }
+    return ret;
+}
+
+// Unmaps and frees count consecutive blocks of an inode, starting at index.
+// Blocks that are not mapped are skipped, so it also works on sparse files.
+// Returns -1 if a shared pointers block could not be copied, see
+// clear_indirect_iblock_run.
+int clear_iblock_run(mount_t *fs, inode_t *file, int index, int count){
+    int ppb = fs->super.pointers_per_block;
+    int region_start[3] = {fs->super.direct_pointers,
+                           fs->super.direct_pointers + ppb,
+                           fs->super.direct_pointers + ppb + ppb*ppb};
+    int region_size[3] = {ppb, ppb*ppb, ppb*ppb*ppb};
+    int *region_root[3] = {&file->indirect1, &file->indirect2, &file->indirect3};
+
+    // direct pointers
+    while(count > 0 && index < fs->super.direct_pointers){
+        if(file->direct[index] != -1){
+            free_iblock(fs, file->direct[index]);
+            file->direct[index] = -1;
         }
-        return ret;
+        index++;
+        count--;
     }
-    index -= ppb*ppb;
 
-    if(file->indirect3 == -1){
-        // allocate new block of pointers
-        int iblock = get_single_available_iblock();
-        if(iblock < 0) return -1;
+    // indirect pointers, one region per height
+    for(int h = 0; h < 3 && count > 0; h++){
+        int rel = index - region_start[h];
+        if(rel >= region_size[h]) continue;
 
-        DataBlock block;
-        for(int i = 0; i < ppb; i++)
-            block.pointers[i] = -1;
-        block_write(super.beg_data + iblock, (char *) &block);
+        int n = region_size[h] - rel;
+        if(n > count) n = count;
 
-        file->indirect3 = iblock;
+        if(clear_indirect_iblock_run(fs, region_root[h], h+1, rel, n) < 0){
+            return -1;
+        }
+        index += n;
+        count -= n;
     }
-    ret = set_indirect_iblock(file->indirect3, 3, index, new_inum);
-    if(is_pointers_block_empty(file->indirect3)){
-        free_iblock(file->indirect3);
-        file->indirect3 = -1;
+    return 0;
+}
+
+// Set the ith block of an inode. Setting it to -1 unmaps the block and
+// frees it, along with any pointers block left empty.
+int set_iblock(mount_t *fs, inode_t *file, int index, int new_inum){
+    if(index >= max_blocks_of_file(fs)){
+        return -1;
     }
-    return ret;
+
+    if(new_inum == -1){
+        return clear_iblock_run(fs, file, index, 1);
+    }
+    return set_iblock_run(fs, file, index, 1, &new_inum);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////
 /*
     Functions to manipulate the map of bits.
+
+    They only change the map in memory, callers must call save_map once
+    they are done with all their allocations. Freed blocks are collected in
+    runs on the free list and cleared from the map all at once. The map,
+    the free list and the reference counts are guarded by alloc_lock, which
+    its holder may take again.
+
+    Both maps span as many blocks as the geometry needs. The blocks changed
+    are marked in map_changed, and save_map only writes those. Allocation
+    starts from a hint below which nothing is free, so it skips the part of
+    the map that is full.
 */
 
-// Return the first available inode and set it as used
-int32_t get_single_available_inode(){
-    for(int i = 0; i < super.num_inodes; i++){
-        if((map.imap[i/8]&(1<<(7-i%8))) == 0){
-            map.imap[i/8] |= (1<<(7-i%8));
-            save_map();
-            return i;
+#define MAP_IS_SET(map, i) (((map)[(i)/8] & (1<<(7-(i)%8))) != 0)
+
+// Mark block b of the map as changed, the inodes map comes first
+static void map_block_changed(mount_t *fs, int b){
+    fs->map_changed[b/8] |= (1<<(7-b%8));
+}
+
+// Set an inode as used or free
+void set_imap_bit(mount_t *fs, int inum, bool_t used){
+    mutex_lock(&fs->alloc_lock);
+    if(used)
+        fs->map.imap[inum/8] |= (1<<(7-inum%8));
+    else
+        fs->map.imap[inum/8] &= ~(1<<(7-inum%8));
+    if(!used && inum < fs->inode_hint) fs->inode_hint = inum;
+    map_block_changed(fs, inum / MAP_BITS);
+    mutex_unlock(&fs->alloc_lock);
+}
+
+// Set a data block as used or free
+void set_dmap_bit(mount_t *fs, int iblock, bool_t used){
+    mutex_lock(&fs->alloc_lock);
+    if(used)
+        fs->map.dmap[iblock/8] |= (1<<(7-iblock%8));
+    else
+        fs->map.dmap[iblock/8] &= ~(1<<(7-iblock%8));
+    if(!used && iblock < fs->block_hint) fs->block_hint = iblock;
+    map_block_changed(fs, fs->super.num_imap_blocks + iblock / MAP_BITS);
+    mutex_unlock(&fs->alloc_lock);
+}
+
+// Returns the first clear bit of a map from hint on, or -1 if there is
+// none below n. Full bytes are skipped at once.
+static int find_clear_bit(char *map, int hint, int n){
+    int i = hint;
+
+    while(i < n){
+        if(i % 8 == 0 && (uint8_t) map[i/8] == 0xFF){
+            i += 8;
+            continue;
         }
+        if(!MAP_IS_SET(map, i)) return i;
+        i++;
     }
     return -1;
 }
 
+// Return the first available inode and set it as used
+int32_t get_single_available_inode(mount_t *fs){
+    int i;
+
+    mutex_lock(&fs->alloc_lock);
+    i = find_clear_bit(fs->map.imap, fs->inode_hint, fs->super.num_inodes);
+    fs->inode_hint = (i < 0) ? fs->super.num_inodes : i + 1;
+    if(i >= 0) set_imap_bit(fs, i, TRUE);
+    mutex_unlock(&fs->alloc_lock);
+    return i;
+}
+
 // Return the first available block and set it as used
-int32_t get_single_available_iblock(){
-    for(int i = 0; i < super.num_data_blocks; i++){
-        if((map.dmap[i/8]&(1<<(7-i%8))) == 0){
-            map.dmap[i/8] |= (1<<(7-i%8));
-            save_map();
-            return i;
-        }
+int32_t get_single_available_iblock(mount_t *fs){
+    int i;
+
+    mutex_lock(&fs->alloc_lock);
+    i = find_clear_bit(fs->map.dmap, fs->block_hint, fs->super.num_data_blocks);
+    fs->block_hint = (i < 0) ? fs->super.num_data_blocks : i + 1;
+    if(i >= 0){
+        set_dmap_bit(fs, i, TRUE);
+        mutex_unlock(&fs->alloc_lock);
+        return i;
+    }
+
+    // blocks freed by the current operation may still be pending
+    if(fs->free_list.nruns > 0){
+        apply_free_list(fs);
+        mutex_unlock(&fs->alloc_lock);
+        return get_single_available_iblock(fs);
+    }
+    mutex_unlock(&fs->alloc_lock);
+
+    // so may the blocks of unlinked files
+    if(fs->super.num_orphans > 0 && reclaim_orphans(fs, -1) > 0){
+        return get_single_available_iblock(fs);
     }
     return -1;
 }
 
-// Mark given iblock as free
-void free_iblock(int32_t inum){
-    map.dmap[inum/8] &= ~(1<<(7-inum%8));
-    save_map();
+// Mark given iblock as free, or drop a reference if it is shared. The block
+// goes to the free list, it is cleared from the map by apply_free_list.
+void free_iblock(mount_t *fs, int32_t inum){
+    int refs, last;
+
+    mutex_lock(&fs->alloc_lock);
+    refs = get_iblock_refs(fs, inum);
+    last = fs->free_list.nruns - 1;
+
+    if(refs > 0){
+        if(refs == 1) fs->shared_blocks--;
+        set_iblock_refs(fs, inum, refs-1);
+    }else if(last >= 0 && fs->free_list.start[last] + fs->free_list.len[last] == inum){
+        // files are mostly laid out in runs, grow the last one if we can
+        fs->free_list.len[last]++;
+    }else if(last >= 0 && fs->free_list.start[last] == inum + 1){
+        fs->free_list.start[last]--;
+        fs->free_list.len[last]++;
+    }else{
+        if(fs->free_list.nruns == FREE_LIST_RUNS){
+            apply_free_list(fs);
+        }
+        fs->free_list.start[fs->free_list.nruns] = inum;
+        fs->free_list.len[fs->free_list.nruns] = 1;
+        fs->free_list.nruns++;
+    }
+    mutex_unlock(&fs->alloc_lock);
+}
+
+// Clear a range of blocks from the map, a byte at a time where possible
+void clear_dmap_range(mount_t *fs, int start, int len){
+    int end = start + len;
+
+    mutex_lock(&fs->alloc_lock);
+    if(start < fs->block_hint) fs->block_hint = start;
+    for(int b = start / MAP_BITS; b <= (end - 1) / MAP_BITS; b++){
+        map_block_changed(fs, fs->super.num_imap_blocks + b);
+    }
+
+    while(start < end && start % 8 != 0){
+        fs->map.dmap[start/8] &= ~(1<<(7-start%8));
+        start++;
+    }
+    while(start + 8 <= end){
+        fs->map.dmap[start/8] = 0;
+        start += 8;
+    }
+    while(start < end){
+        fs->map.dmap[start/8] &= ~(1<<(7-start%8));
+        start++;
+    }
+    mutex_unlock(&fs->alloc_lock);
+}
+
+// Clear all the runs of the free list from the map. With FS_MOUNT_DISCARD
+// the runs are dropped from the image too, before anyone can take them.
+void apply_free_list(mount_t *fs){
+    mutex_lock(&fs->alloc_lock);
+    for(int i = 0; i < fs->free_list.nruns; i++){
+        if(fs->discard)
+            block_discard(&fs->dev, fs->super.beg_data + fs->free_list.start[i], fs->free_list.len[i]);
+        clear_dmap_range(fs, fs->free_list.start[i], fs->free_list.len[i]);
+    }
+    fs->free_list.nruns = 0;
+    mutex_unlock(&fs->alloc_lock);
+}
+
+// Drop every run of free blocks of the map from the image, returns the
+// number of blocks dropped
+int trim_free_blocks(mount_t *fs){
+    int start, end = 0, cnt = 0;
+
+    mutex_lock(&fs->alloc_lock);
+    apply_free_list(fs);
+    while((start = find_clear_bit(fs->map.dmap, end, fs->super.num_data_blocks)) >= 0){
+        for(end = start; end < fs->super.num_data_blocks && !MAP_IS_SET(fs->map.dmap, end); end++);
+        block_discard(&fs->dev, fs->super.beg_data + start, end - start);
+        cnt += end - start;
+    }
+    mutex_unlock(&fs->alloc_lock);
+    return cnt;
 }
 
 // Mark given inode as free
-void free_inode(int32_t inum){
-    map.imap[inum/8] &= ~(1<<(7-inum%8));
-    save_map();
+void free_inode(mount_t *fs, int32_t inum){
+    set_imap_bit(fs, inum, FALSE);
+}
+
+/*
+    Reference counts of data blocks.
+
+    Blocks shared by clones hold, in the reference counts table, how many
+    more inodes or pointers blocks point to them besides the first one.
+    Blocks that are not shared have no extra reference, so the table is only
+    looked up while shared_blocks is not zero.
+*/
+
+// Returns the number of extra references to a data block
+int get_iblock_refs(mount_t *fs, int iblock){
+    Block block;
+
+    if(fs->shared_blocks == 0) return 0;
+
+    mutex_lock(&fs->alloc_lock);
+    block_read(&fs->dev, fs->super.beg_refcount + iblock / REFS_PER_BLOCK, (char *) &block);
+    mutex_unlock(&fs->alloc_lock);
+    return block.refs[iblock % REFS_PER_BLOCK];
+}
+
+// Set the number of extra references to a data block
+void set_iblock_refs(mount_t *fs, int iblock, int refs){
+    Block block;
+
+    mutex_lock(&fs->alloc_lock);
+    block_read(&fs->dev, fs->super.beg_refcount + iblock / REFS_PER_BLOCK, (char *) &block);
+    block.refs[iblock % REFS_PER_BLOCK] = refs;
+    block_write(&fs->dev, fs->super.beg_refcount + iblock / REFS_PER_BLOCK, (char *) &block);
+    mutex_unlock(&fs->alloc_lock);
+}
+
+// Add a reference to a data block, returns -1 if it has too many of them
+int ref_iblock(mount_t *fs, int iblock){
+    int refs;
+
+    mutex_lock(&fs->alloc_lock);
+    refs = get_iblock_refs(fs, iblock);
+    if(refs == MAX_BLOCK_REFS){
+        mutex_unlock(&fs->alloc_lock);
+        return -1;
+    }
+    if(refs == 0) fs->shared_blocks++;
+    set_iblock_refs(fs, iblock, refs+1);
+    mutex_unlock(&fs->alloc_lock);
+
+    return 0;
+}
+
+// Count the shared data blocks, from the table on disk
+int count_shared_blocks(mount_t *fs){
+    Block block;
+    int cnt = 0;
+
+    for(int i = 0; i < fs->super.num_data_blocks; i++){
+        if(i % REFS_PER_BLOCK == 0)
+            block_read(&fs->dev, fs->super.beg_refcount + i / REFS_PER_BLOCK, (char *) &block);
+        cnt += (block.refs[i % REFS_PER_BLOCK] > 0);
+    }
+    return cnt;
+}
+
+/*
+    Gives a private copy of a shared pointers block to its caller, who
+    drops its reference to the original. The blocks it points to gain a
+    reference, since both copies point to them. Returns the new block, or
+    -1 if there is no free block or one of them has too many references.
+*/
+int cow_pointers_block(mount_t *fs, int iblock){
+    DataBlock block;
+
+    int new_iblock = get_single_available_iblock(fs);
+    if(new_iblock < 0) return -1;
+
+    block_read(&fs->dev, fs->super.beg_data + iblock, (char *) &block);
+    for(int i = 0; i < fs->super.pointers_per_block; i++){
+        if(block.pointers[i] != -1 && ref_iblock(fs, block.pointers[i]) < 0){
+            // too many references, drop the ones taken and the copy
+            for(int j = 0; j < i; j++){
+                if(block.pointers[j] != -1)
+                    free_iblock(fs, block.pointers[j]);
+            }
+            free_iblock(fs, new_iblock);
+            return -1;
+        }
+    }
+    block_write(&fs->dev, fs->super.beg_data + new_iblock, (char *) &block);
+
+    free_iblock(fs, iblock);
+    return new_iblock;
+}
+
+// Save the blocks of the map of bits changed to disk, along with the blocks
+// freed so far. Batches of operations write them once, when they are done,
+// or once they deferred MAP_BATCH_DEFER saves, so batches overlapping
+// without end do not keep the map from being written.
+void save_map(mount_t *fs){
+    mutex_lock(&fs->alloc_lock);
+    if(fs->map_batch > 0 && fs->map_deferred < MAP_BATCH_DEFER){
+        apply_free_list(fs);
+        fs->map_deferred++;
+        mutex_unlock(&fs->alloc_lock);
+        return;
+    }
+    sync_map(fs);
+    mutex_unlock(&fs->alloc_lock);
+}
+
+// Same as save_map, even while batches are running, for fs_fsync. The bits
+// of operations still running may be written too, as when another thread
+// saves the map.
+void sync_map(mount_t *fs){
+    int nimap = fs->super.num_imap_blocks;
+    int nblocks = nimap + fs->super.num_dmap_blocks;
+
+    mutex_lock(&fs->alloc_lock);
+    apply_free_list(fs);
+    fs->map_deferred = 0;
+
+    // the inodes map comes first, both in memory and in map_changed
+    for(int b = 0; b < nblocks; b++){
+        if(b % 8 == 0 && fs->map_changed[b/8] == 0){
+            b += 7;
+            continue;
+        }
+        if(!MAP_IS_SET(fs->map_changed, b)) continue;
+
+        if(b < nimap)
+            block_write(&fs->dev, fs->super.beg_imap + b, fs->map.imap + b * BLOCK_SIZE);
+        else
+            block_write(&fs->dev, fs->super.beg_dmap + b - nimap, fs->map.dmap + (b - nimap) * BLOCK_SIZE);
+        fs->map_changed[b/8] &= ~(1<<(7-b%8));
+    }
+    mutex_unlock(&fs->alloc_lock);
+}
+
+// Starts a batch of operations, the map is only written when all the
+// batches running are done
+void begin_map_batch(mount_t *fs){
+    mutex_lock(&fs->alloc_lock);
+    fs->map_batch++;
+    mutex_unlock(&fs->alloc_lock);
+}
+
+void end_map_batch(mount_t *fs){
+    mutex_lock(&fs->alloc_lock);
+    fs->map_batch--;
+    if(fs->map_batch == 0 && fs->map_deferred > 0){
+        save_map(fs);
+    }
+    mutex_unlock(&fs->alloc_lock);
 }
 
-// Save map of bits to disk
-void save_map(){
+// Save superblock to disk
+void save_superblock(mount_t *fs){
     Block aux;
-    aux.map = map;
-    block_write(MAP_BLOCK, (char *) &aux);
+
+    mutex_lock(&fs->alloc_lock);
+    bzero((char *) &aux, BLOCK_SIZE);
+    aux.sb = fs->super;
+    block_write(&fs->dev, 0, (char *) &aux);
+    mutex_unlock(&fs->alloc_lock);
+}
+
+// Save superblock straight to the device, before any block written later
+void sync_superblock(mount_t *fs){
+    Block aux;
+
+    mutex_lock(&fs->alloc_lock);
+    bzero((char *) &aux, BLOCK_SIZE);
+    aux.sb = fs->super;
+    block_write_through(&fs->dev, 0, (char *) &aux);
+    mutex_unlock(&fs->alloc_lock);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////
@@ -260,9 +729,9 @@ void save_map(){
 
 
 // Returns TRUE if directory block is empty, else returns FALSE
-bool_t is_dir_block_empty(int iblock){
+bool_t is_dir_block_empty(mount_t *fs, int iblock){
     DataBlock block;
-    block_read(super.beg_data + iblock, (char *) &block);
+    block_read(&fs->dev, fs->super.beg_data + iblock, (char *) &block);
 
     return (block.dir.files_inum[0] == -1);
 } 
@@ -270,17 +739,17 @@ bool_t is_dir_block_empty(int iblock){
 
 // Remove a file from a given directory inode
 // You must pass the relative index of the block in the inode pointers
-void remove_file_from_dir(inode_t * dir_inode, int ptr_to_remove){
+void remove_file_from_dir(mount_t *fs, inode_t * dir_inode, int ptr_to_remove){
 
     int block_index, current_iblock, next_iblock;
     int i;
 
     // get index of block that we must start delete process
-    block_index = ptr_to_remove/super.pointers_per_dcb; 
-    ptr_to_remove %= super.pointers_per_dcb;
+    block_index = ptr_to_remove/fs->super.pointers_per_dcb; 
+    ptr_to_remove %= fs->super.pointers_per_dcb;
 
     // get the beginning block inum
-    next_iblock = get_iblock(*dir_inode, block_index);
+    next_iblock = get_iblock(fs, *dir_inode, block_index);
 
     do{
         current_iblock = next_iblock; // set current iblock to a new location
@@ -288,21 +757,21 @@ void remove_file_from_dir(inode_t * dir_inode, int ptr_to_remove){
         DataBlock block, next_block;
 
         // load block to memory
-        block_read(super.beg_data + current_iblock, (char *) &block);
+        block_read(&fs->dev, fs->super.beg_data + current_iblock, (char *) &block);
 
         // removes value in ptr_to_remove index
-        for(i = ptr_to_remove; i < super.pointers_per_dcb-1; i++){
+        for(i = ptr_to_remove; i < fs->super.pointers_per_dcb-1; i++){
             bcopy(block.dir.files_name[i+1], block.dir.files_name[i], MAX_FILE_NAME);
             block.dir.files_inum[i] = block.dir.files_inum[i+1];
         }
 
         // get next block to set the last pointer, if there is a next block
-        next_iblock = get_iblock(*dir_inode, ++block_index);
+        next_iblock = get_iblock(fs, *dir_inode, ++block_index);
         if(next_iblock != -1){
 
             // if it exists, we set the last pointer equals the first of the
             // block loaded to memory
-            block_read(super.beg_data + next_iblock, (char *) &next_block);
+            block_read(&fs->dev, fs->super.beg_data + next_iblock, (char *) &next_block);
 
             bcopy(next_block.dir.files_name[0], block.dir.files_name[i], MAX_FILE_NAME);
             block.dir.files_inum[i] = next_block.dir.files_inum[0];
@@ -315,15 +784,14 @@ void remove_file_from_dir(inode_t * dir_inode, int ptr_to_remove){
         }
 
         // write current block to disk
-        block_write(super.beg_data + current_iblock, (char *) &block);
+        block_write(&fs->dev, fs->super.beg_data + current_iblock, (char *) &block);
         ptr_to_remove = 0;
 
     }while(next_iblock != -1);
 
     // delete empty block
-    if(is_dir_block_empty(current_iblock) == TRUE){
-        set_iblock(dir_inode, --block_index, -1); // free last block from dir
-        free_iblock(current_iblock); // free last block from bits map
+    if(is_dir_block_empty(fs, current_iblock) == TRUE){
+        set_iblock(fs, dir_inode, --block_index, -1); // free last block from dir
     }
 }
 
@@ -339,19 +807,24 @@ void remove_file_from_dir(inode_t * dir_inode, int ptr_to_remove){
         (int) - If the file is found, returns its inode pointer
                 else, returns -1 
 */
-int find_file_in_dir(inode_t file, char * fileName, int* relIndex){
+int find_file_in_dir(mount_t *fs, inode_t file, char * fileName, int* relIndex){
     DataBlock block;
     int iblock, num_blocks;
 
-    num_blocks = (file.size + super.pointers_per_dcb - 1) / super.pointers_per_dcb;
+    // a directory removed while its path was walked
+    if(file.type != DIRECTORY){
+        return -1;
+    }
+
+    num_blocks = (file.size + fs->super.pointers_per_dcb - 1) / fs->super.pointers_per_dcb;
     for(int i = 0; i < num_blocks; i++){
-        iblock = get_iblock(file, i);
-        block_read(super.beg_data + iblock, (char *) &block);
+        iblock = get_iblock(fs, file, i);
+        block_read(&fs->dev, fs->super.beg_data + iblock, (char *) &block);
 
-        for(int j = 0; j < super.pointers_per_dcb; j++){
+        for(int j = 0; j < fs->super.pointers_per_dcb; j++){
             if(same_string((char*) fileName, (char*) block.dir.files_name[j]) ){
                 if(relIndex != NULL){
-                    *relIndex = i * super.pointers_per_dcb + j;
+                    *relIndex = i * fs->super.pointers_per_dcb + j;
                 }
                 return block.dir.files_inum[j];
             }
@@ -363,25 +836,28 @@ int find_file_in_dir(inode_t file, char * fileName, int* relIndex){
 
 
 // Insert a new entry in a directory
-int insert_file_in_dir(inode_t * dir, char * fileName, int32_t inum){
-    
-    int num_blocks = (dir->size + super.pointers_per_dcb - 1) / super.pointers_per_dcb;
+int insert_file_in_dir(mount_t *fs, inode_t * dir, char * fileName, int32_t inum){
+    if(dir->type != DIRECTORY){
+        return -1;
+    }
+
+    int num_blocks = (dir->size + fs->super.pointers_per_dcb - 1) / fs->super.pointers_per_dcb;
     // read last block
-    int32_t last_block_inum = get_iblock(*dir, num_blocks-1);
+    int32_t last_block_inum = get_iblock(fs, *dir, num_blocks-1);
     if(last_block_inum < 0){
         return -1;
     }
 
     DataBlock block;
-    block_read(super.beg_data + last_block_inum, (char *) &block);
+    block_read(&fs->dev, fs->super.beg_data + last_block_inum, (char *) &block);
 
     // try to insert 
-    for(int i = 0; i < super.pointers_per_dcb; i++){
+    for(int i = 0; i < fs->super.pointers_per_dcb; i++){
         if(block.dir.files_inum[i] == -1){
             bcopy((uint8_t *)fileName, (uint8_t *)block.dir.files_name[i], strlen(fileName)+1);
             block.dir.files_inum[i] = inum;
 
-            block_write(super.beg_data + last_block_inum, (char *) &block);
+            block_write(&fs->dev, fs->super.beg_data + last_block_inum, (char *) &block);
             return 0;
         }
     }
@@ -390,7 +866,7 @@ int insert_file_in_dir(inode_t * dir, char * fileName, int32_t inum){
     // if function gets here, it means we must add another block
     
     // allocate a new block if possible
-    int new_iblock = get_single_available_iblock();
+    int new_iblock = get_single_available_iblock(fs);
     if(new_iblock < 0){
         return -1;
     }
@@ -398,7 +874,7 @@ int insert_file_in_dir(inode_t * dir, char * fileName, int32_t inum){
 
     // Nullify entries on the new allocated data block
     DataBlock new_block;
-    for(int i = 0; i < super.pointers_per_dcb; i++){
+    for(int i = 0; i < fs->super.pointers_per_dcb; i++){
         bzero((char *) new_block.dir.files_name[i], MAX_FILE_NAME);
         new_block.dir.files_inum[i] = -1;
     }
@@ -408,29 +884,27 @@ int insert_file_in_dir(inode_t * dir, char * fileName, int32_t inum){
     new_block.dir.files_inum[0] = inum;
     
     num_blocks++;
-    if(set_iblock(dir, num_blocks-1, new_iblock) < 0){
-        free_iblock(new_iblock);
+    if(set_iblock(fs, dir, num_blocks-1, new_iblock) < 0){
+        free_iblock(fs, new_iblock);
         return -1;
     }
 
     // write blocks to disk
-    block_write(super.beg_data + new_iblock, (char *) &new_block);
+    block_write(&fs->dev, fs->super.beg_data + new_iblock, (char *) &new_block);
     
-    // save map of bits
-    save_map();
-
-    save_inode(current_dir.files_inum[0], *dir);
+    // save map of bits, the caller saves the inode of the directory
+    save_map(fs);
 
     return 0;
 }
 
 
 // Returns an empty directory
-dir_t create_directory(int inum){
+dir_t create_directory(mount_t *fs, int inum, int parent_inum){
     dir_t new_dir;
 
     // nullify all entries from dcb
-    for(int i = 0; i < super.pointers_per_dcb; i++){
+    for(int i = 0; i < fs->super.pointers_per_dcb; i++){
         bzero((char *) new_dir.files_name[i], MAX_FILE_NAME);
         new_dir.files_inum[i] = -1;
     }
@@ -439,24 +913,120 @@ dir_t create_directory(int inum){
     bcopy((uint8_t *)  ".",(uint8_t *) new_dir.files_name[0], 2);
     bcopy((uint8_t *) "..",(uint8_t *) new_dir.files_name[1], 3);
     new_dir.files_inum[0] = inum;
-    new_dir.files_inum[1] = current_dir.files_inum[0];
+    new_dir.files_inum[1] = parent_inum;
 
     return new_dir;
 }
 
 
 // Returns TRUE, if the directory is empty else returns FALSE
-bool_t is_directory_empty(inode_t dir){
+bool_t is_directory_empty(mount_t *fs, inode_t dir){
     if(dir.size > 2){
         return FALSE;
     }
 
     DataBlock block;
-    block_read(super.beg_data + dir.direct[0], (char *) &block);
+    block_read(&fs->dev, fs->super.beg_data + dir.direct[0], (char *) &block);
 
     return (block.dir.files_inum[2] == -1);
 }
 
+// Entry of the cache of directories for a name in the directory parent
+int dcache_hash(int parent, char *name){
+    unsigned int h = parent;
+
+    for(int i = 0; name[i] != 0; i++)
+        h = h * 31 + (unsigned char) name[i];
+    return h % DCACHE_ENTRIES;
+}
+
+/*
+    Returns the directory named name in the directory dir, or -1 if there
+    is none. Directories found are kept in a cache, so walking the same
+    path again reads no directory block.
+*/
+int lookup_dir(mount_t *fs, int dir, char *name){
+    dcache_entry_t *entry = &fs->dcache[dcache_hash(dir, name)];
+    int inum = -1, gen;
+
+    mutex_lock(&fs->dcache_lock);
+    if(entry->parent == dir && same_string(entry->name, name))
+        inum = entry->inum;
+    gen = fs->dcache_gen;
+    mutex_unlock(&fs->dcache_lock);
+    if(inum >= 0){
+        return inum;
+    }
+
+    lock_inode(fs, dir, LOCK_READ);
+    inum = find_file_in_dir(fs, get_inode_per_inum(fs, dir), name, NULL);
+    unlock_inode(fs, dir);
+    if(inum < 0 || get_inode_per_inum(fs, inum).type != DIRECTORY){
+        return -1;
+    }
+
+    // not cached if a directory was removed meanwhile, it may be this one
+    mutex_lock(&fs->dcache_lock);
+    if(gen == fs->dcache_gen){
+        entry->parent = dir;
+        entry->inum = inum;
+        bcopy((uint8_t *) name, (uint8_t *) entry->name, strlen(name)+1);
+    }
+    mutex_unlock(&fs->dcache_lock);
+
+    return inum;
+}
+
+// Drops the cached entries of a directory being removed, and the ones
+// inside it. All of them are dropped for inum -1.
+void dcache_forget(mount_t *fs, int inum){
+    mutex_lock(&fs->dcache_lock);
+    for(int i = 0; i < DCACHE_ENTRIES; i++){
+        if(inum == -1 || fs->dcache[i].parent == inum || fs->dcache[i].inum == inum)
+            fs->dcache[i].parent = -1;
+    }
+    fs->dcache_gen++;
+    mutex_unlock(&fs->dcache_lock);
+}
+
+/*
+    Walks a path, from the directory cwd unless it starts with '/'. Returns
+    the directory holding the last component of the path, which is copied
+    to name, or -1 if a directory on the way does not exist or a component
+    is too long. A path without components, like "/", names the "." entry
+    of the directory it starts from.
+*/
+int walk_path(mount_t *fs, int cwd, char *path, char *name){
+    int dir = (path[0] == '/') ? 0 : cwd;
+    int len;
+
+    bcopy((uint8_t *) ".", (uint8_t *) name, 2);
+    while(*path == '/') path++;
+
+    while(*path != 0){
+        for(len = 0; path[len] != 0 && path[len] != '/'; len++);
+        if(len >= MAX_FILE_NAME){
+            return -1;
+        }
+        bcopy((uint8_t *) path, (uint8_t *) name, len);
+        name[len] = 0;
+
+        path += len;
+        while(*path == '/') path++;
+        if(*path == 0){
+            // last component
+            break;
+        }
+
+        dir = lookup_dir(fs, dir, name);
+        if(dir < 0){
+            return -1;
+        }
+    }
+
+    return dir;
+}
+
 
 /////////////////////////////////////////////////////////////////////////////////////
 
@@ -465,25 +1035,30 @@ bool_t is_directory_empty(inode_t dir){
 */
 
 // Save to disk given inode in the given index
-void save_inode(int index, inode_t inode){
-    int iblock = index / super.inodes_per_block;
+// Inodes sharing a block may be saved at once, itable_lock keeps the
+// block from being rewritten with stale neighbours
+void save_inode(mount_t *fs, int index, inode_t inode){
+    int iblock = index / fs->super.inodes_per_block;
 
     Block block;
-    block_read(super.beg_inodes + iblock, (char *) &block);
+    mark_itable_dirty(fs, iblock);
+    mutex_lock(&fs->itable_lock);
+    block_read(&fs->dev, fs->super.beg_inodes + iblock, (char *) &block);
 
-    block.inodes[index%super.inodes_per_block] = inode;
+    block.inodes[index%fs->super.inodes_per_block] = inode;
 
-    block_write(super.beg_inodes + iblock, (char *) &block);
+    block_write(&fs->dev, fs->super.beg_inodes + iblock, (char *) &block);
+    mutex_unlock(&fs->itable_lock);
 }
 
 // Retuns an inode given its index on disk
-inode_t get_inode_per_inum(int index){
-    int iblock = index / super.inodes_per_block;
+inode_t get_inode_per_inum(mount_t *fs, int index){
+    int iblock = index / fs->super.inodes_per_block;
 
     Block block;
-    block_read(super.beg_inodes + iblock, (char *) &block);
+    block_read(&fs->dev, fs->super.beg_inodes + iblock, (char *) &block);
 
-    return block.inodes[index%super.inodes_per_block];
+    return block.inodes[index%fs->super.inodes_per_block];
 }
 
 
@@ -493,86 +1068,1157 @@ inode_t get_inode_per_inum(int index){
     Operation on Table of Open Files
 */
 
-int get_single_available_fd(){
-    for(int fd = 0; fd < MAX_OPEN_FILES; fd++){
-        if(table[fd].fd == -1)
-            return fd;
-    }
-    return -1;
-}
-
-/////////////////////////////////////////////////////////////////////////////////////
-
 /*
-    Operations on Files
+    The table of a file system grows a chunk of FD_CHUNK entries at a time,
+    taken from a pool shared by all the file systems. Chunks never move, so
+    descriptors are looked up without any lock. Free entries are linked in
+    FD_SHARDS free lists, picked by inode number, so threads opening
+    different files seldom take the same lock. The descriptors open on each
+    inode are counted, the last close and unlink need no scan of the table.
 */
+static FileDescriptor fd_pool[MAX_OPEN_FILES / FD_CHUNK][FD_CHUNK];
+static bool_t fd_pool_used[MAX_OPEN_FILES / FD_CHUNK];
+static mutex_t fd_pool_lock = MUTEX_INITIALIZER; // guards the pool and fd_nchunks
 
-void free_all_data_blocks_indirect(int iblock, int height){
-    if(height >= 1){
-        DataBlock block;
-        block_read(super.beg_data + iblock, (char *) &block);
-        for(int i = 0; i < super.pointers_per_block; i++){
-            if(block.pointers[i] == -1) break;
-            if(height > 1)
-                free_all_data_blocks_indirect(block.pointers[i], height-1);
-            free_iblock(block.pointers[i]);
-        }
+// Entry of a descriptor of the table, open or not
+static FileDescriptor *fd_entry(mount_t *fs, int fd){
+    return &fs->fd_chunks[fd / FD_CHUNK][fd % FD_CHUNK];
+}
+
+// Sets up the table of a file system being mounted or formatted, with no
+// descriptor open
+void init_fd_table(mount_t *fs){
+    release_fd_table(fs);
+    for(int i = 0; i < FD_SHARDS; i++){
+        fs->fd_shards[i].head = -1;
+    }
+    bzero((char *) fs->open_counts, fs->super.num_inodes * sizeof(int));
+    bzero((char *) fs->map_counts, fs->super.num_inodes * sizeof(int));
+
+    for(int i = 0; i < MAX_WRITE_BUFFERS; i++){
+        fs->wbufs[i].fd = -1;
     }
+    fs->dirty_wbufs = 0;
 }
 
-// Free all data blocks of an inode by setting all its allocated blocks as free
-void free_all_data_blocks(inode_t inode){
-    int num_blocks = (inode.size + super.block_size -1) / super.block_size;
-    for(int i = 0; i < super.direct_pointers && i < num_blocks; i++){
-        free_iblock(inode.direct[i]);
+// Gives the chunks of the table back to the pool
+void release_fd_table(mount_t *fs){
+    mutex_lock(&fd_pool_lock);
+    for(int i = 0; i < fs->fd_nchunks; i++){
+        fd_pool_used[(fs->fd_chunks[i] - fd_pool[0]) / FD_CHUNK] = FALSE;
     }
-    if(inode.indirect1 != -1){
-        free_all_data_blocks_indirect(inode.indirect1, 1);
-        free_iblock(inode.indirect1);
+    fs->fd_nchunks = 0;
+    mutex_unlock(&fd_pool_lock);
+}
+
+// Adds a chunk of free entries to a free list, whose lock is held. Returns
+// -1 if the pool is used up.
+static int grow_fd_table(mount_t *fs, fd_shard_t *shard){
+    int chunk, first;
+
+    mutex_lock(&fd_pool_lock);
+    for(chunk = 0; chunk < MAX_OPEN_FILES / FD_CHUNK && fd_pool_used[chunk]; chunk++);
+    if(chunk == MAX_OPEN_FILES / FD_CHUNK){
+        mutex_unlock(&fd_pool_lock);
+        return -1;
     }
-    if(inode.indirect2 != -1){
-        free_all_data_blocks_indirect(inode.indirect2, 2);
-        free_iblock(inode.indirect2);
+    fd_pool_used[chunk] = TRUE;
+
+    first = fs->fd_nchunks * FD_CHUNK;
+    for(int i = 0; i < FD_CHUNK; i++){
+        fd_pool[chunk][i].fd = -1;
+        fd_pool[chunk][i].next_free = (i + 1 < FD_CHUNK) ? first + i + 1 : shard->head;
     }
-    if(inode.indirect3 != -1){
-        free_all_data_blocks_indirect(inode.indirect3, 3);
-        free_iblock(inode.indirect3);
+    fs->fd_chunks[fs->fd_nchunks] = fd_pool[chunk];
+    atomic_add(&fs->fd_nchunks, 1); // the chunk is set up before get_fd sees it
+    shard->head = first;
+    mutex_unlock(&fd_pool_lock);
+
+    return 0;
+}
+
+// Returns the entry of an open descriptor, or NULL if fd is not open
+FileDescriptor *get_fd(mount_t *fs, int fd){
+    FileDescriptor *file;
+
+    if(fd < 0 || fd >= atomic_load(&fs->fd_nchunks) * FD_CHUNK){
+        return NULL;
     }
+    file = fd_entry(fs, fd);
+
+    return (file->fd == -1) ? NULL : file;
 }
 
-// Check if a pointers block is empty
-bool_t is_pointers_block_empty(int iblock){
-    DataBlock block;
-    block_read(super.beg_data+iblock, (char*) &block);
-    return (block.pointers[0] == -1);
+// Takes a free entry of the table for the given descriptor, returns its
+// number or -1 if the table is full. The table grows when the free list of
+// the inode is empty, and once it cannot, entries are taken from the others.
+int get_single_available_fd(mount_t *fs, FileDescriptor *file){
+    fd_shard_t *shard;
+    int fd;
+
+    for(int i = 0; i < FD_SHARDS; i++){
+        shard = &fs->fd_shards[(file->inode + i) % FD_SHARDS];
+        mutex_lock(&shard->lock);
+        if(shard->head != -1 || (i == 0 && grow_fd_table(fs, shard) == 0)){
+            fd = shard->head;
+            shard->head = fd_entry(fs, fd)->next_free;
+            *fd_entry(fs, fd) = *file;
+            fd_entry(fs, fd)->fd = fd;
+            mutex_unlock(&shard->lock);
+
+            atomic_add(&fs->open_counts[file->inode], 1);
+            return fd;
+        }
+        mutex_unlock(&shard->lock);
+    }
+
+    return -1;
 }
 
-/////////////////////////////////////////////////////////////////////////////////////
+// Releases the entry of a descriptor, its buffer already flushed. Returns
+// TRUE if it was the last one open for its inode.
+bool_t release_fd(mount_t *fs, int fd){
+    FileDescriptor *file = fd_entry(fs, fd);
+    fd_shard_t *shard = &fs->fd_shards[file->inode % FD_SHARDS];
+    bool_t last = (atomic_add(&fs->open_counts[file->inode], -1) == 0);
 
-/*
-    General Purpose
-*/
+    mutex_lock(&shard->lock);
+    file->fd = -1;
+    file->next_free = shard->head;
+    shard->head = fd;
+    mutex_unlock(&shard->lock);
 
-int max_blocks_of_file(){
-    int aux = super.pointers_per_block;
-    return aux * aux * aux + // triple indirect
-           aux * aux + // double indirect
-           aux + // simple indirect
-           super.direct_pointers; // direct pointer
+    return last;
 }
 
-int blocks_used(){
-    int cnt = 0;
-    for(int i = 0; i < super.num_data_blocks; i++){
-        cnt += ((map.dmap[i/8] & (1<<(7-i%8))) > 0);
-    } 
-    return cnt;
+// Returns TRUE if an inode has any file descriptor open
+bool_t is_inode_open(mount_t *fs, int inum){
+    return atomic_load(&fs->open_counts[inum]) > 0;
 }
 
-int inodes_used(){
-    int cnt = 0;
-    for(int i = 0; i < super.num_inodes; i++){
-        cnt += ((map.imap[i/8] & (1<<(7-i%8))) > 0);
-    } 
-    return cnt;
+// Returns TRUE if a range of an inode is mapped, its blocks must not be
+// freed until it is unmapped
+bool_t is_inode_mapped(mount_t *fs, int inum){
+    return atomic_load(&fs->map_counts[inum]) > 0;
+}
+
+/*
+    Write-behind buffers are taken from a pool of MAX_WRITE_BUFFERS by the
+    descriptors writing, and given back once flushed. A buffer belongs to
+    its descriptor but is flushed through any descriptor of the same file,
+    so its data is only touched while holding the lock of the inode for
+    writing. wbuf_lock guards taking and giving back the buffers.
+*/
+
+// Takes a free buffer for a descriptor, returns its number or -1 if all
+// of them hold data
+static int take_wbuf(mount_t *fs, int fd){
+    int i;
+
+    mutex_lock(&fs->wbuf_lock);
+    for(i = 0; i < MAX_WRITE_BUFFERS && fs->wbufs[i].fd != -1; i++);
+    if(i < MAX_WRITE_BUFFERS){
+        fs->wbufs[i].fd = fd;
+        fs->wbufs[i].inode = fd_entry(fs, fd)->inode;
+        fs->wbufs[i].len = 0;
+        atomic_add(&fs->dirty_wbufs, 1);
+    }else{
+        i = -1;
+    }
+    mutex_unlock(&fs->wbuf_lock);
+
+    return i;
+}
+
+// Writes the write-behind buffer of a file descriptor to the file.
+// Returns -1 if this or a previous flush of this descriptor failed.
+int flush_fd(mount_t *fs, int fd){
+    FileDescriptor *file = fd_entry(fs, fd);
+    wbuf_t *wbuf;
+
+    if(file->wbuf != -1){
+        wbuf = &fs->wbufs[file->wbuf];
+        file->wbuf = -1;
+        if(write_file(fs, file->inode, wbuf->offset, wbuf->data, wbuf->len) != wbuf->len){
+            file->wbuf_error = TRUE;
+        }
+
+        mutex_lock(&fs->wbuf_lock);
+        wbuf->fd = -1;
+        atomic_add(&fs->dirty_wbufs, -1);
+        mutex_unlock(&fs->wbuf_lock);
+    }
+
+    return (file->wbuf_error == TRUE) ? -1 : 0;
+}
+
+// Flushes every descriptor open for the given inode, but except_fd (which
+// may be -1), so reads and writes through any of them are ordered after the
+// data written through the others. The caller holds the inode for writing,
+// which is also held whenever data of the inode is buffered, so its
+// buffers cannot change while they are flushed.
+void flush_inode_fds(mount_t *fs, int inum, int except_fd){
+    int fds[MAX_WRITE_BUFFERS], n = 0;
+    int dirty = atomic_load(&fs->dirty_wbufs);
+
+    // nothing buffered, or only by except_fd
+    if(dirty == 0 || (except_fd != -1 && dirty == 1 && 
+            fd_entry(fs, except_fd)->wbuf != -1)) return;
+
+    mutex_lock(&fs->wbuf_lock);
+    for(int i = 0; i < MAX_WRITE_BUFFERS; i++){
+        if(fs->wbufs[i].fd != -1 && fs->wbufs[i].fd != except_fd && fs->wbufs[i].inode == inum)
+            fds[n++] = fs->wbufs[i].fd;
+    }
+    mutex_unlock(&fs->wbuf_lock);
+
+    for(int i = 0; i < n; i++){
+        flush_fd(fs, fds[i]);
+    }
+}
+
+// Flushes the write-behind buffers of all open descriptors. The caller
+// must not hold any inode lock.
+void flush_all_fds(mount_t *fs){
+    int fd, inum;
+
+    for(int i = 0; i < MAX_WRITE_BUFFERS && atomic_load(&fs->dirty_wbufs) > 0; i++){
+        mutex_lock(&fs->wbuf_lock);
+        fd = fs->wbufs[i].fd;
+        inum = fs->wbufs[i].inode;
+        mutex_unlock(&fs->wbuf_lock);
+        if(fd == -1) continue;
+
+        // it may have been flushed before the inode was locked
+        lock_inode(fs, inum, LOCK_WRITE);
+        if(fd_entry(fs, fd)->wbuf == i && fd_entry(fs, fd)->inode == inum)
+            flush_fd(fs, fd);
+        unlock_inode(fs, inum);
+    }
+}
+
+// Returns TRUE if a write-behind buffer holds data of the inode
+static bool_t is_inode_buffered(mount_t *fs, int inum){
+    bool_t found = FALSE;
+
+    if(atomic_load(&fs->dirty_wbufs) == 0) return FALSE;
+
+    mutex_lock(&fs->wbuf_lock);
+    for(int i = 0; i < MAX_WRITE_BUFFERS && !found; i++){
+        found = (fs->wbufs[i].fd != -1 && fs->wbufs[i].inode == inum);
+    }
+    mutex_unlock(&fs->wbuf_lock);
+
+    return found;
+}
+
+// Flushes the buffered data of an inode, for callers that only need to
+// read it and do not hold its lock. The lock is only taken for writing
+// when a buffer of the inode is dirty, buffers of other inodes don't
+// hold up its readers.
+void sync_inode_fds(mount_t *fs, int inum){
+    if(!is_inode_buffered(fs, inum)) return;
+
+    lock_inode(fs, inum, LOCK_WRITE);
+    flush_inode_fds(fs, inum, -1);
+    unlock_inode(fs, inum);
+}
+
+/*
+    Appends count bytes of buf to the write-behind buffer of a file
+    descriptor, at its R/W pointer. The buffer holds a single block, so it
+    is flushed as soon as a block is filled, or whenever the write is not
+    contiguous to the buffered data.
+*/
+int buffer_write(mount_t *fs, int fd, char *buf, int count){
+    FileDescriptor *file = fd_entry(fs, fd);
+    fs_off_t offset = file->rw_ptr;
+    wbuf_t *wbuf;
+    int done = 0, len;
+
+    while(done < count){
+        // a buffer only holds contiguous data of a single block
+        if(file->wbuf != -1 &&
+                fs->wbufs[file->wbuf].offset + fs->wbufs[file->wbuf].len != offset + done){
+            flush_fd(fs, fd);
+        }
+
+        if(file->wbuf == -1){
+            file->wbuf = take_wbuf(fs, fd);
+            // every buffer holds data, the rest goes straight to the file. The
+            // buffers of other files can't be flushed here, we don't hold their locks
+            if(file->wbuf == -1){
+                len = count - done;
+                if(write_file(fs, file->inode, offset + done, buf + done, len) != len){
+                    return -1;
+                }
+                break;
+            }
+            fs->wbufs[file->wbuf].offset = offset + done;
+        }
+        wbuf = &fs->wbufs[file->wbuf];
+
+        len = fs->super.block_size - (offset + done) % fs->super.block_size;
+        if(len > count - done){
+            len = count - done;
+        }
+        bcopy((uint8_t *) buf + done, (uint8_t *) wbuf->data + wbuf->len, len);
+        wbuf->len += len;
+        done += len;
+
+        // the block is full, write it back
+        if((offset + done) % fs->super.block_size == 0){
+            flush_fd(fs, fd);
+        }
+    }
+
+    return (file->wbuf_error == TRUE) ? -1 : count;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+/*
+    Operations on Files
+*/
+
+// Free all data blocks of an inode. Its block tree is walked once, bottom-up,
+// and the blocks are released in runs through the free list.
+void free_all_data_blocks(mount_t *fs, inode_t inode){
+    clear_iblock_run(fs, &inode, 0, max_blocks_of_file(fs));
+}
+
+// Count the blocks allocated under a pointers block, including itself
+int count_iblocks_indirect(mount_t *fs, int iblock, int height){
+    DataBlock block;
+    int cnt = 1;
+
+    block_read(&fs->dev, fs->super.beg_data + iblock, (char *) &block);
+    for(int i = 0; i < fs->super.pointers_per_block; i++){
+        if(block.pointers[i] == -1) continue; // hole
+        if(height > 1)
+            cnt += count_iblocks_indirect(fs, block.pointers[i], height-1);
+        else
+            cnt++;
+    }
+    return cnt;
+}
+
+// Count the blocks allocated to an inode, data and pointers blocks.
+// Holes of sparse files are not counted.
+int count_iblocks(mount_t *fs, inode_t inode){
+    int cnt = 0;
+    for(int i = 0; i < fs->super.direct_pointers; i++){
+        cnt += (inode.direct[i] != -1);
+    }
+    if(inode.indirect1 != -1) cnt += count_iblocks_indirect(fs, inode.indirect1, 1);
+    if(inode.indirect2 != -1) cnt += count_iblocks_indirect(fs, inode.indirect2, 2);
+    if(inode.indirect3 != -1) cnt += count_iblocks_indirect(fs, inode.indirect3, 3);
+    return cnt;
+}
+
+/*
+    Cursors over the buffers of a vectored I/O
+*/
+
+// Returns the bytes of the buffers of a vectored I/O, or -1 if a length is
+// negative or the total would not fit the int the I/O returns
+int iov_length(iovec_t *iov, int iovcnt){
+    fs_off_t count = 0;
+
+    for(int i = 0; i < iovcnt; i++){
+        if(iov[i].len < 0) return -1;
+        count += iov[i].len;
+        if(count > MAX_IO_COUNT) return -1;
+    }
+    return (int) count;
+}
+
+// Skips the buffers of a cursor that were fully consumed
+void iov_settle(iov_cursor_t *cursor){
+    while(cursor->index < cursor->iovcnt && 
+            cursor->offset == cursor->iov[cursor->index].len){
+        cursor->index++;
+        cursor->offset = 0;
+    }
+}
+
+// Returns the next len bytes of a cursor and moves it forward if they are
+// contiguous in a single buffer, else returns NULL and the cursor stays put
+char *iov_contig(iov_cursor_t *cursor, int len){
+    iov_settle(cursor);
+    if(cursor->index == cursor->iovcnt ||
+            cursor->iov[cursor->index].len - cursor->offset < len){
+        return NULL;
+    }
+
+    char *ptr = cursor->iov[cursor->index].base + cursor->offset;
+    cursor->offset += len;
+    return ptr;
+}
+
+// Copies len bytes of src to the buffers of a cursor, or zeros if src is NULL
+void iov_scatter(iov_cursor_t *cursor, char *src, int len){
+    int n;
+
+    while(len > 0){
+        iov_settle(cursor);
+        n = cursor->iov[cursor->index].len - cursor->offset;
+        if(n > len) n = len;
+
+        char *dst = cursor->iov[cursor->index].base + cursor->offset;
+        if(src == NULL){
+            bzero(dst, n);
+        }else{
+            bcopy((uint8_t *) src, (uint8_t *) dst, n);
+            src += n;
+        }
+        cursor->offset += n;
+        len -= n;
+    }
+}
+
+// Copies len bytes from the buffers of a cursor to dst
+void iov_gather(iov_cursor_t *cursor, char *dst, int len){
+    int n;
+
+    while(len > 0){
+        iov_settle(cursor);
+        n = cursor->iov[cursor->index].len - cursor->offset;
+        if(n > len) n = len;
+
+        bcopy((uint8_t *) cursor->iov[cursor->index].base + cursor->offset, (uint8_t *) dst, n);
+        cursor->offset += n;
+        dst += n;
+        len -= n;
+    }
+}
+
+/*
+    Read the file with the given inode number, starting at offset, into the
+    buffers of iov, in order and in a single pass over its block map.
+    Reading stops at the end of the file. Returns the number of bytes read.
+*/
+int read_file_iov(mount_t *fs, int inum, fs_off_t offset, iovec_t *iov, int iovcnt){
+    fs_off_t index_block;
+    int rw, len, done, nblocks, count = 0;
+    int iblocks[BLOCK_RUN];
+    iov_cursor_t cursor = {.iov = iov, .iovcnt = iovcnt, .index = 0, .offset = 0};
+    inode_t current_inode;
+    DataBlock block;
+    char *dst;
+
+    count = iov_length(iov, iovcnt);
+    if(count <= 0){
+        return count;
+    }
+
+    current_inode = get_inode_per_inum(fs, inum);
+
+    // never read past the end of the file
+    if(offset >= current_inode.size){
+        return 0;
+    }
+    if(count > current_inode.size - offset){
+        count = current_inode.size - offset;
+    }
+
+    done = 0;
+    while(done < count){
+        // resolve the next run of blocks at once
+        rw = (offset + done) % fs->super.block_size;
+        nblocks = (rw + count - done + fs->super.block_size - 1) / fs->super.block_size;
+        if(nblocks > BLOCK_RUN){
+            nblocks = BLOCK_RUN;
+        }
+        index_block = (offset + done) / fs->super.block_size;
+        get_iblock_run(fs, current_inode, index_block, nblocks, iblocks);
+
+        for(int i = 0; i < nblocks && done < count; i++, rw = 0){
+            len = fs->super.block_size - rw;
+            if(len > count - done){
+                len = count - done;
+            }
+
+            if(iblocks[i] == -1){
+                // hole of a sparse file, reads as zeros
+                iov_scatter(&cursor, NULL, len);
+            }else if(len == fs->super.block_size && (dst = iov_contig(&cursor, len)) != NULL){
+                // whole block, read it straight into the caller buffer
+                block_read(&fs->dev, fs->super.beg_data + iblocks[i], dst);
+            }else{
+                // partial head or tail block, or spanning many buffers
+                block_read(&fs->dev, fs->super.beg_data + iblocks[i], (char *) &block);
+                iov_scatter(&cursor, (char *) block.data + rw, len);
+            }
+            done += len;
+        }
+    }
+
+    return count;
+}
+
+// Same as write_file_iov, with a single buffer
+int write_file(mount_t *fs, int inum, fs_off_t offset, char *buf, int count){
+    iovec_t iov = {.base = buf, .len = count};
+    return write_file_iov(fs, inum, offset, &iov, 1);
+}
+
+/*
+    Write the buffers of iov, in order, to the file with the given inode
+    number starting at offset, in a single pass over its block map.
+    Returns the number of bytes written, or -1 if nothing could be written.
+*/
+int write_file_iov(mount_t *fs, int inum, fs_off_t offset, iovec_t *iov, int iovcnt){
+    fs_off_t start, end, pos, index_block;
+    int rw, len, nblocks, i, count = 0;
+    iov_cursor_t cursor = {.iov = iov, .iovcnt = iovcnt, .index = 0, .offset = 0};
+    char *src;
+    int iblocks[BLOCK_RUN], mapped[BLOCK_RUN], old[BLOCK_RUN];
+    bool_t fresh[BLOCK_RUN], allocated;
+    bool_t inode_dirty = FALSE, bits_dirty = FALSE, full = FALSE;
+    inode_t current_inode;
+    DataBlock block;
+
+    count = iov_length(iov, iovcnt);
+    if(count <= 0){
+        return count;
+    }
+
+    // the block index would not fit the block tree of the file
+    if(offset < 0 || offset + count > max_file_size(fs)){
+        return -1;
+    }
+
+    current_inode = get_inode_per_inum(fs, inum);
+
+    // if offset is past the end of the file, the gap is left as a hole
+    start = pos = offset;
+    end = start + count;
+
+    while(pos < end && !full){
+        // resolve the next run of blocks at once
+        index_block = pos / fs->super.block_size;
+        nblocks = (pos % fs->super.block_size + end - pos + fs->super.block_size - 1) / fs->super.block_size;
+        if(nblocks > BLOCK_RUN){
+            nblocks = BLOCK_RUN;
+        }
+        // blocks shared with clones must be copied before being written,
+        // so first make the pointers blocks of the run private to the file
+        if(fs->shared_blocks > 0){
+            inode_t before = current_inode;
+            if(set_iblock_run(fs, &current_inode, index_block, nblocks, NULL) < 0){
+                nblocks = 0;
+                full = TRUE;
+            }
+            bits_dirty = TRUE;
+            inode_dirty |= (before.indirect1 != current_inode.indirect1 ||
+                            before.indirect2 != current_inode.indirect2 ||
+                            before.indirect3 != current_inode.indirect3);
+        }
+        get_iblock_run(fs, current_inode, index_block, nblocks, iblocks);
+
+        // allocate the blocks of this run that are not mapped yet, or that
+        // are still shared with another file
+        allocated = FALSE;
+        for(i = 0; i < nblocks; i++){
+            old[i] = iblocks[i];
+            fresh[i] = (iblocks[i] == -1);
+            if(fresh[i] == FALSE && get_iblock_refs(fs, iblocks[i]) == 0) continue;
+
+            if(index_block + i >= max_blocks_of_file(fs) || 
+                    (iblocks[i] = get_single_available_iblock(fs)) < 0){
+                // printf("write: File has maximum size.\n");
+                iblocks[i] = old[i];
+                nblocks = i;
+                full = TRUE;
+                break;
+            }
+            allocated = bits_dirty = inode_dirty = TRUE;
+        }
+
+        if(allocated && set_iblock_run(fs, &current_inode, index_block, nblocks, iblocks) < 0){
+            // keep only the blocks that could be mapped
+            get_iblock_run(fs, current_inode, index_block, nblocks, mapped);
+            for(i = 0; i < nblocks && mapped[i] == iblocks[i]; i++);
+            for(int j = i; j < nblocks; j++){
+                if(iblocks[j] != old[j] && mapped[j] != iblocks[j]) free_iblock(fs, iblocks[j]);
+            }
+            nblocks = i;
+            full = TRUE;
+        }
+
+        // drop the references to the shared blocks that were replaced
+        for(i = 0; i < nblocks; i++){
+            if(old[i] != -1 && iblocks[i] != old[i]) free_iblock(fs, old[i]);
+        }
+
+        for(i = 0; i < nblocks && pos < end; i++, pos += len){
+            rw = pos % fs->super.block_size;
+            len = fs->super.block_size - rw;
+            if(len > end - pos){
+                len = end - pos;
+            }
+
+            if(len == fs->super.block_size && (src = iov_contig(&cursor, len)) != NULL){
+                // block is fully overwritten, there is no need to read it
+                block_write(&fs->dev, fs->super.beg_data + iblocks[i], src);
+                continue;
+            }
+
+            // partial block, fresh blocks only need to be zeroed. A whole
+            // block spanning many buffers is just gathered in memory
+            if(len < fs->super.block_size){
+                if(fresh[i]){
+                    bzero((char *) &block, fs->super.block_size);
+                }else{
+                    block_read(&fs->dev, fs->super.beg_data + old[i], (char *) &block);
+                }
+            }
+            iov_gather(&cursor, (char *) block.data + rw, len);
+
+            block_write(&fs->dev, fs->super.beg_data + iblocks[i], (char *) &block);
+        }
+    }
+
+    // update size and save metadata only if it has changed
+    if(pos > start && pos > current_inode.size){
+        current_inode.size = pos;
+        inode_dirty = TRUE;
+    }
+    if(inode_dirty){
+        save_inode(fs, inum, current_inode); // save inode
+    }
+    if(bits_dirty){
+        save_map(fs);
+    }
+
+    if(pos <= start){
+        // printf("write: Couldn't write string to file.\n");
+        return -1;
+    }
+
+    return pos - start;
+}
+
+/*
+    Changes the size of a file. Growing it just leaves a hole at its end.
+    Shrinking it zeroes the tail of the new last block, since the space past
+    the end of a file must read as zeros, and unmaps the blocks past the new
+    end. Those are walked once and released in runs with a single save_map.
+    A file with a range mapped is not shrunk, returning -1.
+*/
+int truncate_file(mount_t *fs, int inum, fs_off_t size){
+    fs_off_t to;
+    int first, last;
+    inode_t inode = get_inode_per_inum(fs, inum);
+
+    if(size < 0 || size > max_file_size(fs)){
+        return -1;
+    }
+
+    // blocks of a mapped range are kept until it is unmapped
+    if(size < inode.size && is_inode_mapped(fs, inum)){
+        return -1;
+    }
+
+    if(size < inode.size){
+        if(size % fs->super.block_size != 0 && get_iblock(fs, inode, size / fs->super.block_size) != -1){
+            to = (size / fs->super.block_size + 1) * fs->super.block_size;
+            if(to > inode.size) to = inode.size;
+            if(write_file(fs, inum, size, zero_block, to - size) < 0){
+                return -1;
+            }
+            inode = get_inode_per_inum(fs, inum);
+        }
+
+        first = (size + fs->super.block_size - 1) / fs->super.block_size;
+        last = (inode.size + fs->super.block_size - 1) / fs->super.block_size;
+        if(first < last && clear_iblock_run(fs, &inode, first, last - first) < 0){
+            // the size is kept, so the blocks left are still reachable
+            save_inode(fs, inum, inode);
+            save_map(fs);
+            return -1;
+        }
+    }
+
+    inode.size = size;
+    save_inode(fs, inum, inode);
+    save_map(fs);
+    return 0;
+}
+
+// Check if a pointers block is empty
+bool_t is_pointers_block_empty(mount_t *fs, int iblock){
+    DataBlock block;
+    block_read(&fs->dev, fs->super.beg_data+iblock, (char*) &block);
+    for(int i = 0; i < fs->super.pointers_per_block; i++){
+        if(block.pointers[i] != -1) return FALSE;
+    }
+    return TRUE;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+/*
+    Orphan list
+
+    Files whose last link is gone are not freed right away, their inodes are
+    recorded in the superblock and fs_reclaim frees them a batch of blocks at
+    a time. The list is kept on disk, so fs_init finishes the job after a
+    crash.
+*/
+
+// Add an inode to the orphan list, returns -1 if the list is full
+int add_orphan(mount_t *fs, int inum){
+    mutex_lock(&fs->alloc_lock);
+    if(fs->super.num_orphans == MAX_ORPHANS){
+        mutex_unlock(&fs->alloc_lock);
+        return -1;
+    }
+    fs->super.orphans[fs->super.num_orphans++] = inum;
+    save_superblock(fs);
+    mutex_unlock(&fs->alloc_lock);
+    return 0;
+}
+
+// Returns the position of an inode on the orphan list, or -1
+int find_orphan(mount_t *fs, int inum){
+    mutex_lock(&fs->alloc_lock);
+    for(int i = 0; i < (int) fs->super.num_orphans; i++){
+        if(fs->super.orphans[i] == inum){
+            mutex_unlock(&fs->alloc_lock);
+            return i;
+        }
+    }
+    mutex_unlock(&fs->alloc_lock);
+    return -1;
+}
+
+// Remove an inode from the orphan list, the last entry takes its place
+void remove_orphan(mount_t *fs, int inum){
+    mutex_lock(&fs->alloc_lock);
+    int index = find_orphan(fs, inum);
+    if(index >= 0){
+        fs->super.orphans[index] = fs->super.orphans[--fs->super.num_orphans];
+        save_superblock(fs);
+    }
+    mutex_unlock(&fs->alloc_lock);
+}
+
+/*
+    Frees the blocks of unlinked files on the orphan list, up to max_blocks
+    of them, or all of them if max_blocks is negative. Each file is shrunk
+    from its end and its inode is freed once it is empty. Files still open
+    or mapped are skipped until they are closed and unmapped. Returns the number of orphans freed.
+*/
+int reclaim_orphans(mount_t *fs, int max_blocks){
+    int i = 0, inum, nblocks, n, freed = 0;
+    inode_t inode;
+
+    // only one thread reclaims at a time. Reclaiming may also allocate
+    // blocks to copy shared pointers blocks, and the allocator reclaims
+    // when the disk is full, so this keeps it from nesting too
+    if(!mutex_trylock(&fs->reclaim_lock)) return 0;
+
+    while(max_blocks != 0){
+        mutex_lock(&fs->alloc_lock);
+        inum = (i < (int) fs->super.num_orphans) ? fs->super.orphans[i] : -1;
+        mutex_unlock(&fs->alloc_lock);
+        if(inum == -1) break;
+
+        // the lock of an orphan may be shared with a busy inode, and we may
+        // be called by the allocator on behalf of its holder, never wait
+        if(!trylock_inode(fs, inum)){
+            i++;
+            continue;
+        }
+        inode = get_inode_per_inum(fs, inum);
+
+        // linked again before a crash, nothing to free
+        if(inode.link_counter != 0){
+            remove_orphan(fs, inum);
+            unlock_inode(fs, inum);
+            continue;
+        }
+
+        if(is_inode_open(fs, inum) || is_inode_mapped(fs, inum)){
+            unlock_inode(fs, inum);
+            i++;
+            continue;
+        }
+
+        nblocks = (inode.size + fs->super.block_size - 1) / fs->super.block_size;
+        n = (max_blocks < 0 || max_blocks > nblocks) ? nblocks : max_blocks;
+        if(max_blocks > 0) max_blocks -= n;
+
+        if(n < nblocks){
+            // the inode is saved before the map, a crash here leaks the
+            // blocks until the next fsck instead of leaving them mapped
+            if(clear_iblock_run(fs, &inode, nblocks - n, n) < 0){
+                // no room to copy a shared pointers block, retried later
+                save_inode(fs, inum, inode);
+                save_map(fs);
+                unlock_inode(fs, inum);
+                i++;
+                continue;
+            }
+            inode.size = (fs_off_t) (nblocks - n) * fs->super.block_size;
+            save_inode(fs, inum, inode);
+            save_map(fs);
+            unlock_inode(fs, inum);
+            continue;
+        }
+
+        // last batch, the inode goes away too
+        remove_orphan(fs, inum);
+        free_all_data_blocks(fs, inode);
+        free_inode(fs, inum);
+        save_map(fs);
+        unlock_inode(fs, inum);
+        freed++;
+    }
+
+    mutex_unlock(&fs->reclaim_lock);
+    return freed;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+/*
+    Durability
+*/
+
+// Makes everything written so far stable, for fs_fsync and fs_sync. In
+// FS_MOUNT_DURABLE_NONE the cache is only written back.
+void sync_device(mount_t *fs, bool_t data_only){
+    if(fs->durability == FS_MOUNT_DURABLE_NONE)
+        block_sync(&fs->dev);
+    else
+        block_flush(&fs->dev, data_only);
+}
+
+// Called by the operations changing the file system before they return,
+// makes their changes stable in FS_MOUNT_DURABLE_OP. Nothing is flushed
+// when the operation wrote nothing.
+void commit_op(mount_t *fs){
+    if(fs->durability == FS_MOUNT_DURABLE_OP)
+        block_flush(&fs->dev, FALSE);
+}
+
+/*
+    The superblock records the blocks of the inode table changed since the
+    last checkpoint, when the file system was last known to be consistent
+    on disk. A block is recorded, and the superblock written through to the
+    device and flushed, before the block itself is first written, so after a
+    crash or a power loss fs_mount only checks the inodes of the blocks
+    recorded. The entries of a
+    directory only change along with its inode, they are covered too. Each
+    bit records dirty_itable_span blocks, large inode tables are recorded
+    at a coarser grain.
+*/
+
+// Bit of dirty_itable recording a block of the inode table
+static int itable_dirty_bit(mount_t *fs, int iblock){
+    return iblock / fs->super.dirty_itable_span;
+}
+
+// Record a block of the inode table as changed, before it is written
+void mark_itable_dirty(mount_t *fs, int iblock){
+    int i = itable_dirty_bit(fs, iblock);
+    int bit = (int) (1u << (i % 32));
+
+    if(atomic_load(&fs->super.dirty_itable[i/32]) & bit) return;
+
+    mutex_lock(&fs->alloc_lock);
+    if((fs->super.dirty_itable[i/32] & bit) == 0){
+        Block aux;
+
+        // the bit is set in memory once the superblock recording it is
+        // stable, until then writers of the block wait on alloc_lock
+        bzero((char *) &aux, BLOCK_SIZE);
+        aux.sb = fs->super;
+        aux.sb.dirty_itable[i/32] |= bit;
+        block_write_through(&fs->dev, 0, (char *) &aux);
+        if(fs->durability != FS_MOUNT_DURABLE_NONE)
+            block_barrier(&fs->dev);
+        atomic_fetch_or(&fs->super.dirty_itable[i/32], bit);
+    }
+    mutex_unlock(&fs->alloc_lock);
+}
+
+// Returns TRUE if a block of the inode table may have changed since the
+// last checkpoint, the blocks sharing its bit are recorded along with it
+bool_t is_itable_block_dirty(mount_t *fs, int iblock){
+    int i = itable_dirty_bit(fs, iblock);
+
+    return (atomic_load(&fs->super.dirty_itable[i/32]) & (int) (1u << (i % 32))) != 0;
+}
+
+// Returns TRUE if a block of the inode table changed since the last checkpoint
+bool_t is_itable_dirty(mount_t *fs){
+    for(int i = 0; i < DIRTY_ITABLE_BITS/32; i++){
+        if(atomic_load(&fs->super.dirty_itable[i]) != 0) return TRUE;
+    }
+    return FALSE;
+}
+
+// Write everything back and record that the file system is consistent on
+// disk. Called with every inode locked and the descriptors flushed, so no
+// operation is halfway through, the map is written even if batches of
+// operations are running.
+void checkpoint(mount_t *fs){
+    mutex_lock(&fs->alloc_lock);
+
+    // the blocks must be on stable storage before the superblock stops
+    // recording them, in every durability mode
+    sync_map(fs);
+    block_flush(&fs->dev, FALSE);
+    bzero((char *) fs->super.dirty_itable, sizeof(fs->super.dirty_itable));
+    sync_superblock(fs);
+    mutex_unlock(&fs->alloc_lock);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+/*
+    Locks
+
+    Inodes are locked through a fixed set of reader-writer locks, the inode
+    number picks the lock. Directories are inodes, their lock guards their
+    entries too. The bits map, reference counts and orphan list are guarded
+    by alloc_lock and the inode table by itable_lock. The table of open
+    files has a lock per free list, see get_single_available_fd. Inode
+    locks are taken first, and two of them in the order of their lock.
+*/
+
+#ifdef FAKE
+void mutex_init_recursive(mutex_t *m){
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+#endif
+
+// Set up the locks of a file system being mounted
+void init_locks(mount_t *fs){
+    for(int i = 0; i < INODE_LOCK_STRIPES; i++){
+        rw_init(&fs->inode_locks[i]);
+    }
+    mutex_init_recursive(&fs->alloc_lock);
+    mutex_init(&fs->itable_lock);
+    for(int i = 0; i < FD_SHARDS; i++){
+        mutex_init(&fs->fd_shards[i].lock);
+    }
+    mutex_init(&fs->wbuf_lock);
+    mutex_init(&fs->reclaim_lock);
+    mutex_init(&fs->dcache_lock);
+}
+
+// Lock an inode for reading (LOCK_READ) or writing (LOCK_WRITE)
+void lock_inode(mount_t *fs, int inum, int mode){
+    if(mode == LOCK_WRITE)
+        rw_wrlock(&fs->inode_locks[inum % INODE_LOCK_STRIPES]);
+    else
+        rw_rdlock(&fs->inode_locks[inum % INODE_LOCK_STRIPES]);
+}
+
+// Lock an inode for writing if nobody holds its lock, returns TRUE if it did
+bool_t trylock_inode(mount_t *fs, int inum){
+    return rw_trywrlock(&fs->inode_locks[inum % INODE_LOCK_STRIPES]);
+}
+
+void unlock_inode(mount_t *fs, int inum){
+    rw_unlock(&fs->inode_locks[inum % INODE_LOCK_STRIPES]);
+}
+
+// Lock two inodes, such as a directory and one of its files. They may
+// share a lock, which is then taken once, for writing if any of them is.
+void lock_inodes(mount_t *fs, int a, int mode_a, int b, int mode_b){
+    int la = a % INODE_LOCK_STRIPES, lb = b % INODE_LOCK_STRIPES;
+
+    if(la == lb){
+        lock_inode(fs, a, (mode_a == LOCK_WRITE || mode_b == LOCK_WRITE) ? LOCK_WRITE : LOCK_READ);
+    }else if(la < lb){
+        lock_inode(fs, a, mode_a);
+        lock_inode(fs, b, mode_b);
+    }else{
+        lock_inode(fs, b, mode_b);
+        lock_inode(fs, a, mode_a);
+    }
+}
+
+void unlock_inodes(mount_t *fs, int a, int b){
+    unlock_inode(fs, a);
+    if(a % INODE_LOCK_STRIPES != b % INODE_LOCK_STRIPES)
+        unlock_inode(fs, b);
+}
+
+// Lock every inode for writing, in stripe order, stopping all operations
+void lock_all_inodes(mount_t *fs){
+    for(int i = 0; i < INODE_LOCK_STRIPES; i++){
+        rw_wrlock(&fs->inode_locks[i]);
+    }
+}
+
+void unlock_all_inodes(mount_t *fs){
+    for(int i = INODE_LOCK_STRIPES - 1; i >= 0; i--){
+        rw_unlock(&fs->inode_locks[i]);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+/*
+    General Purpose
+*/
+
+/*
+    Lays out a file system of nblocks blocks with num_inodes inodes, a
+    multiple of INODES_PER_BLOCK. The inode table and the inodes map follow
+    the superblock, the data blocks take what is left but the blocks map and
+    the reference counts table they need, which come last. Returns -1 if
+    there is no room for a data block.
+*/
+int set_geometry(superblock_t *sb, int nblocks, int num_inodes){
+    int left, data;
+
+    sb->num_inodes = num_inodes;
+    sb->num_blocks_inodes = num_inodes / INODES_PER_BLOCK;
+    sb->num_imap_blocks = (num_inodes + MAP_BITS - 1) / MAP_BITS;
+    sb->beg_inodes = 1;
+    sb->beg_imap = sb->beg_inodes + sb->num_blocks_inodes;
+    sb->beg_data = sb->beg_imap + sb->num_imap_blocks;
+    if((int) sb->beg_data >= nblocks) return -1;
+
+    // each data block takes a bit of the map and a reference count
+    left = nblocks - sb->beg_data;
+    data = (int) ((long long) left * MAP_BITS * REFS_PER_BLOCK /
+                  (MAP_BITS * REFS_PER_BLOCK + MAP_BITS + REFS_PER_BLOCK));
+    while(data > 0 && data + (data + MAP_BITS - 1) / MAP_BITS + (data + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK > left){
+        data--;
+    }
+    if(data <= 0) return -1;
+
+    sb->size_disk = nblocks;
+    sb->num_data_blocks = data;
+    sb->num_dmap_blocks = (data + MAP_BITS - 1) / MAP_BITS;
+    sb->num_refcount_blocks = (data + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK;
+    sb->beg_dmap = sb->beg_data + data;
+    sb->beg_refcount = sb->beg_dmap + sb->num_dmap_blocks;
+    sb->dirty_itable_span = (sb->num_blocks_inodes + DIRTY_ITABLE_BITS - 1) / DIRTY_ITABLE_BITS;
+    return 0;
+}
+
+/*
+    Memory of the tables sized by the geometry of a file system, zeroed.
+    The kernel build has no heap, it takes them from an arena of
+    FS_HEAP_SIZE bytes, which is reused once all of them are freed.
+*/
+#ifdef FAKE
+void *fs_alloc(ulong_t size){
+    return calloc(1, size);
+}
+
+void fs_free(void *p){
+    free(p);
+}
+#else
+static char heap[FS_HEAP_SIZE];
+static ulong_t heap_used;
+static int heap_users;
+
+void *fs_alloc(ulong_t size){
+    char *p;
+
+    size = (size + 7) & ~7ul;
+    if(size > FS_HEAP_SIZE - heap_used) return NULL;
+    p = heap + heap_used;
+    heap_used += size;
+    heap_users++;
+    bzero(p, size);
+    return p;
+}
+
+void fs_free(void *p){
+    if(p != NULL && --heap_users == 0) heap_used = 0;
+}
+#endif
+
+/*
+    Allocates the tables sized by the geometry of a file system being
+    mounted or formatted: its map of bits, read from the image if load is
+    TRUE and clear otherwise, and the open and map counts of its inodes. Returns -1
+    if there is no memory for them.
+*/
+int alloc_tables(mount_t *fs, bool_t load){
+    int nimap = fs->super.num_imap_blocks, ndmap = fs->super.num_dmap_blocks;
+
+    fs->map.imap = fs_alloc((ulong_t) nimap * BLOCK_SIZE);
+    fs->map.dmap = fs_alloc((ulong_t) ndmap * BLOCK_SIZE);
+    fs->map_changed = fs_alloc((nimap + ndmap + 7) / 8);
+    fs->open_counts = fs_alloc((ulong_t) fs->super.num_inodes * sizeof(int));
+    fs->map_counts = fs_alloc((ulong_t) fs->super.num_inodes * sizeof(int));
+    if(fs->map.imap == NULL || fs->map.dmap == NULL || fs->map_changed == NULL ||
+       fs->open_counts == NULL || fs->map_counts == NULL){
+        release_tables(fs);
+        return -1;
+    }
+
+    for(int b = 0; load && b < nimap; b++){
+        block_read(&fs->dev, fs->super.beg_imap + b, fs->map.imap + b * BLOCK_SIZE);
+    }
+    for(int b = 0; load && b < ndmap; b++){
+        block_read(&fs->dev, fs->super.beg_dmap + b, fs->map.dmap + b * BLOCK_SIZE);
+    }
+    fs->inode_hint = 0;
+    fs->block_hint = 0;
+    return 0;
+}
+
+void release_tables(mount_t *fs){
+    fs_free(fs->map.imap);
+    fs_free(fs->map.dmap);
+    fs_free(fs->map_changed);
+    fs_free(fs->open_counts);
+    fs_free(fs->map_counts);
+    fs->map.imap = fs->map.dmap = fs->map_changed = NULL;
+    fs->open_counts = fs->map_counts = NULL;
+}
+
+
+// Computed on 64 bits, the triple indirect alone overflows 32 bits with
+// blocks of 8 KiB
+fs_off_t max_blocks_of_file(mount_t *fs){
+    fs_off_t aux = fs->super.pointers_per_block;
+    return aux * aux * aux + // triple indirect
+           aux * aux + // double indirect
+           aux + // simple indirect
+           fs->super.direct_pointers; // direct pointer
+}
+
+// Largest size of a file, no offset written or size set may pass it. With
+// blocks of 512 bytes it is about 1 GB.
+fs_off_t max_file_size(mount_t *fs){
+    return max_blocks_of_file(fs) * fs->super.block_size;
+}
+
+// Count the bits set of a map of n bits, the bits past n are clear
+static int count_bits(char *map, int n){
+    int cnt = 0;
+
+    for(int i = 0; i < (n + 7) / 8; i++){
+        cnt += __builtin_popcount((uint8_t) map[i]);
+    }
+    return cnt;
+}
+
+int blocks_used(mount_t *fs){
+    return count_bits(fs->map.dmap, fs->super.num_data_blocks);
+}
+
+int inodes_used(mount_t *fs){
+    return count_bits(fs->map.imap, fs->super.num_inodes);
 }
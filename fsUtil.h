@@ -2,57 +2,231 @@
 #define FSUTIL_INCLUDED
 
 #include "common.h"
+#include "fs.h"
+#include "lock.h"
+
+// Asynchronous interface of a mounted file system, see fsAsync.c
+typedef struct{
+    fsOp sq[ASYNC_QUEUE_DEPTH]; // queued operations, a ring
+    int sq_head, sq_len;
+    fsCompletion cq[ASYNC_QUEUE_DEPTH]; // completions, a ring
+    int cq_head, cq_len;
+    int in_flight; // submitted and not reaped yet
+    mutex_t queue_lock;
+    cond_t work_ready, work_done;
+    thread_t workers[ASYNC_WORKERS];
+    bool_t started; // workers are running
+    bool_t stopping; // workers exit once the queue is empty
+} async_t;
+
+// Write-behind buffer, holds small writes of a single block through a
+// descriptor
+typedef struct{
+    char data[BLOCK_SIZE];
+    fs_off_t offset; // offset in the file of the first byte buffered
+    int len; // number of bytes buffered
+    int fd; // descriptor owning it, -1 if the buffer is free
+    int inode; // inode of that descriptor
+} wbuf_t;
+
+// Free list of the open-files table, entries are linked by next_free
+typedef struct{
+    int head; // first free entry, -1 if none
+    mutex_t lock;
+} fd_shard_t;
+
+// Directory cached by the path walks, see walk_path
+typedef struct{
+    int parent; // directory holding it, -1 if the entry is free
+    int inum;
+    char name[MAX_FILE_NAME];
+} dcache_entry_t;
+
+// A mounted file system, shared by all its sessions
+typedef struct{
+    bool_t mounted; // entry of the mounts table in use
+    blockdev_t dev; // image of the file system and its block cache
+
+    superblock_t super;
+    bmap_t map;
+    char *map_changed; // blocks of the map changed since it was last written, a bit each, the inodes map first
+    int inode_hint; // no inode below it is free
+    int block_hint; // no data block below it is free
+
+    // open-files table, grown a chunk at a time, see get_single_available_fd
+    FileDescriptor *fd_chunks[MAX_OPEN_FILES / FD_CHUNK];
+    int fd_nchunks;
+    fd_shard_t fd_shards[FD_SHARDS];
+    int *open_counts; // number of descriptors open on each inode
+    int *map_counts; // number of ranges mapped by fs_map_range on each inode
+
+    wbuf_t wbufs[MAX_WRITE_BUFFERS];
+    int dirty_wbufs; // number of write-behind buffers holding data
+    mutex_t wbuf_lock; // guards taking and releasing the buffers
+
+    int shared_blocks; // number of data blocks shared by clones
+    free_list_t free_list; // data blocks freed but not yet cleared from the map
+    int map_batch; // save_map only marks the map dirty while this is not zero
+    int map_deferred; // saves of the map deferred by batches since it was last written
+
+    rwlock_t inode_locks[INODE_LOCK_STRIPES]; // locks of the inodes, see lock_inode
+    mutex_t alloc_lock; // guards the bits map, reference counts and orphan list
+    mutex_t itable_lock; // guards the blocks of the inode table
+    mutex_t reclaim_lock; // held by the thread reclaiming orphans
+
+    dcache_entry_t dcache[DCACHE_ENTRIES]; // directories found by path walks
+    int dcache_gen; // bumped whenever entries are dropped
+    mutex_t dcache_lock;
+
+    async_t async;
+    int durability; // FS_MOUNT_DURABLE_*
+    bool_t discard; // FS_MOUNT_DISCARD, freed blocks are dropped from the image
+} mount_t;
+
+// A session on a mounted file system, handed to every fs_* call. Sessions
+// share the files of their mount, but each one has a working directory.
+struct fs{
+    mount_t *mount; // NULL if the entry of the sessions table is free
+    int cwd; // inode of the working directory
+};
 
 /* 
     Function to get and set block index number from inode.
 */
-int get_indirect_block(uint32_t, int, int);
-int get_iblock(inode_t, int);
-int set_indirect_iblock(uint32_t, int, int, int);
-int set_iblock(inode_t*, int, int);
+int get_indirect_iblock(mount_t*, uint32_t, int, int);
+int get_iblock(mount_t*, inode_t, int);
+void get_indirect_iblock_run(mount_t*, int, int, int, int, int*);
+void get_iblock_run(mount_t*, inode_t, int, int, int*);
+int set_iblock(mount_t*, inode_t*, int, int);
+int set_indirect_iblock_run(mount_t*, int*, int, int, int, int*);
+int set_iblock_run(mount_t*, inode_t*, int, int, int*);
+int clear_indirect_iblock_run(mount_t*, int*, int, int, int);
+int clear_iblock_run(mount_t*, inode_t*, int, int);
 
 /*
     Functions to manipulate the map of bits.
 */
-int get_single_available_inode();
-int get_single_available_iblock();
-void free_iblock(int);
-void free_inode(int);
-void save_map();
+int get_single_available_inode(mount_t*);
+int get_single_available_iblock(mount_t*);
+void free_iblock(mount_t*, int);
+void free_inode(mount_t*, int);
+void set_imap_bit(mount_t*, int, bool_t);
+void set_dmap_bit(mount_t*, int, bool_t);
+void clear_dmap_range(mount_t*, int, int);
+void apply_free_list(mount_t*);
+int trim_free_blocks(mount_t*);
+void save_map(mount_t*);
+void sync_map(mount_t*);
+void begin_map_batch(mount_t*);
+void end_map_batch(mount_t*);
+void save_superblock(mount_t*);
+void sync_superblock(mount_t*);
+int get_iblock_refs(mount_t*, int);
+void set_iblock_refs(mount_t*, int, int);
+int ref_iblock(mount_t*, int);
+int count_shared_blocks(mount_t*);
+int cow_pointers_block(mount_t*, int);
 
 /*
     Operations over directories
 */
-bool_t is_dir_block_empty(int iblock);
-void remove_file_from_dir(inode_t *, int);
-int find_file_in_dir(inode_t, char*, int*);
-int insert_file_in_dir(inode_t*, char*, int);
-dir_t create_directory(int);
-bool_t is_directory_empty(inode_t);
+bool_t is_dir_block_empty(mount_t*, int iblock);
+void remove_file_from_dir(mount_t*, inode_t *, int);
+int find_file_in_dir(mount_t*, inode_t, char*, int*);
+int insert_file_in_dir(mount_t*, inode_t*, char*, int);
+dir_t create_directory(mount_t*, int, int);
+bool_t is_directory_empty(mount_t*, inode_t);
+int dcache_hash(int, char*);
+int lookup_dir(mount_t*, int, char*);
+void dcache_forget(mount_t*, int);
+int walk_path(mount_t*, int, char*, char*);
 
 /*
     Operations over inodes
 */
-void save_inode(int, inode_t);
-inode_t get_inode_per_inum(int);
+void save_inode(mount_t*, int, inode_t);
+inode_t get_inode_per_inum(mount_t*, int);
 
 /*
     Operation on Table of Open Files
 */
-int get_single_available_fd();
+void init_fd_table(mount_t*);
+void release_fd_table(mount_t*);
+FileDescriptor *get_fd(mount_t*, int);
+int get_single_available_fd(mount_t*, FileDescriptor*);
+bool_t release_fd(mount_t*, int);
+bool_t is_inode_open(mount_t*, int);
+bool_t is_inode_mapped(mount_t*, int);
+int flush_fd(mount_t*, int);
+void flush_inode_fds(mount_t*, int, int);
+void flush_all_fds(mount_t*);
+void sync_inode_fds(mount_t*, int);
+int buffer_write(mount_t*, int, char*, int);
 
 /*
     Operations on Files
 */
-void free_all_data_blocks_indirect(int, int);
-void free_all_data_blocks(inode_t);
-bool_t is_pointers_block_empty(int);
+void free_all_data_blocks(mount_t*, inode_t);
+int iov_length(iovec_t*, int);
+void iov_settle(iov_cursor_t*);
+char *iov_contig(iov_cursor_t*, int);
+void iov_scatter(iov_cursor_t*, char*, int);
+void iov_gather(iov_cursor_t*, char*, int);
+int read_file_iov(mount_t*, int, fs_off_t, iovec_t*, int);
+int write_file_iov(mount_t*, int, fs_off_t, iovec_t*, int);
+int write_file(mount_t*, int, fs_off_t, char*, int);
+int truncate_file(mount_t*, int, fs_off_t);
+int count_iblocks_indirect(mount_t*, int, int);
+int count_iblocks(mount_t*, inode_t);
+bool_t is_pointers_block_empty(mount_t*, int);
+
+/*
+    Orphan list
+*/
+int add_orphan(mount_t*, int);
+int find_orphan(mount_t*, int);
+void remove_orphan(mount_t*, int);
+int reclaim_orphans(mount_t*, int);
+
+/*
+    Locks
+*/
+void init_locks(mount_t*);
+void lock_inode(mount_t*, int, int);
+bool_t trylock_inode(mount_t*, int);
+void unlock_inode(mount_t*, int);
+void lock_inodes(mount_t*, int, int, int, int);
+void unlock_inodes(mount_t*, int, int);
+void lock_all_inodes(mount_t*);
+void unlock_all_inodes(mount_t*);
+
+/*
+    Asynchronous interface
+*/
+void init_async(mount_t*);
+void stop_async(mount_t*);
+
+/*
+    Durability
+*/
+void sync_device(mount_t*, bool_t);
+void commit_op(mount_t*);
+void mark_itable_dirty(mount_t*, int);
+bool_t is_itable_block_dirty(mount_t*, int);
+bool_t is_itable_dirty(mount_t*);
+void checkpoint(mount_t*);
 
 /*
     General Purpose
 */
-int max_blocks_of_file();
-int blocks_used();
-int inodes_used();
+int set_geometry(superblock_t*, int, int);
+void *fs_alloc(ulong_t);
+void fs_free(void*);
+int alloc_tables(mount_t*, bool_t);
+void release_tables(mount_t*);
+fs_off_t max_blocks_of_file(mount_t*);
+fs_off_t max_file_size(mount_t*);
+int blocks_used(mount_t*);
+int inodes_used(mount_t*);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,86 @@
+/*	lock.h
+
+	Locks of the file system. The fake build runs on pthreads, while the
+	kernel build runs a single thread and its locks compile to nothing.
+*/
+
+#ifndef LOCK_INCLUDED
+#define LOCK_INCLUDED
+
+#include "common.h"
+
+#ifdef FAKE
+#include <pthread.h>
+
+typedef pthread_mutex_t mutex_t;
+typedef pthread_rwlock_t rwlock_t;
+typedef pthread_cond_t cond_t;
+typedef pthread_t thread_t;
+
+#define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define COND_INITIALIZER PTHREAD_COND_INITIALIZER
+
+#define mutex_init(m) pthread_mutex_init(m, NULL)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_trylock(m) (pthread_mutex_trylock(m) == 0)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+
+#define rw_init(l) pthread_rwlock_init(l, NULL)
+#define rw_rdlock(l) pthread_rwlock_rdlock(l)
+#define rw_wrlock(l) pthread_rwlock_wrlock(l)
+#define rw_trywrlock(l) (pthread_rwlock_trywrlock(l) == 0)
+#define rw_unlock(l) pthread_rwlock_unlock(l)
+
+#define cond_init(c) pthread_cond_init(c, NULL)
+#define cond_wait(c, m) pthread_cond_wait(c, m)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+
+#define atomic_add(p, v) __sync_add_and_fetch(p, v)
+#define atomic_load(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define atomic_fetch_or(p, v) __sync_fetch_and_or(p, v)
+
+#define thread_create(t, f, arg) pthread_create(t, NULL, f, arg)
+#define thread_join(t) pthread_join(t, NULL)
+
+// A mutex its holder may take again, used by the block allocator
+void mutex_init_recursive(mutex_t *m);
+
+#else
+
+typedef int mutex_t;
+typedef int rwlock_t;
+typedef int cond_t;
+typedef int thread_t;
+
+#define MUTEX_INITIALIZER 0
+#define COND_INITIALIZER 0
+
+#define mutex_init(m) ((void) (m))
+#define mutex_init_recursive(m) ((void) (m))
+#define mutex_lock(m) ((void) (m))
+#define mutex_trylock(m) TRUE
+#define mutex_unlock(m) ((void) (m))
+
+#define rw_init(l) ((void) (l))
+#define rw_rdlock(l) ((void) (l))
+#define rw_wrlock(l) ((void) (l))
+#define rw_trywrlock(l) TRUE
+#define rw_unlock(l) ((void) (l))
+
+#define cond_init(c) ((void) (c))
+#define cond_wait(c, m) ((void) (c))
+#define cond_broadcast(c) ((void) (c))
+
+#define atomic_add(p, v) (*(p) += (v))
+#define atomic_load(p) (*(p))
+
+static inline int atomic_fetch_or(int *p, int v) {
+	int old = *p;
+
+	*p |= v;
+	return old;
+}
+
+#endif
+
+#endif
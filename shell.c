@@ -9,10 +9,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-extern superblock_t super;
-extern dir_t current_dir;
 #endif
 
+fs_t *fs; // file system of the shell, mounted by shell_init
+
+#define SHELL_MAP_BITS 4096 // bits of each map printed by fsck, the first ones
+
 char line[SIZEX+1];
 char *argv[SIZEX];
 int argc;
@@ -30,18 +32,27 @@ static void shell_open(void);
 static void shell_read(void);
 static void shell_write(void);
 static void shell_lseek(void);
+static void shell_punch(void);
+static void shell_truncate(void);
 static void shell_close(void);
+static void shell_fsync(void);
+static void shell_sync(void);
 static void shell_mkdir(void);
 static void shell_rmdir(void);
 static void shell_cd(void);
 static void shell_link(void);
 static void shell_unlink(void);
+static void shell_clone(void);
 static void shell_stat(void);
 static void shell_fsck(void);
+static void shell_reclaim(void);
+static void shell_fstrim(void);
+static void shell_resize(void);
 
 static void shell_ls(void);
 static void shell_create(void);
 static void shell_cat(void);
+static void shell_cp(void);
 
 #define EXEC_COMMAND(c, l, m, s, code) { \
     if (same_string(c, argv[0])) { \
@@ -58,6 +69,9 @@ int START(void) {
 	shell_init();
 	
 	while(1) {
+		// free some blocks of unlinked files between commands
+		fs_reclaim(fs, RECLAIM_BATCH);
+
 		writeStr("# ");
 		readLine();
 		parseLine();
@@ -67,22 +81,31 @@ int START(void) {
 		EXEC_COMMAND("exit",   1,  1, "", shell_exit());
 		EXEC_COMMAND("fire",   1,  1, "", shell_fire());
 		EXEC_COMMAND("clear",  1,  1, "", shell_clearscreen());
-		EXEC_COMMAND("mkfs",   1,  1, "", shell_mkfs());
+		EXEC_COMMAND("mkfs",   1,  3, " [MiB [bytes per inode]]", shell_mkfs());
 		EXEC_COMMAND("open",   3,  3, "", shell_open());
 		EXEC_COMMAND("read",   3,  3, "", shell_read());
 		EXEC_COMMAND("write",  3,  3, "", shell_write());
 		EXEC_COMMAND("lseek",  3,  3, "", shell_lseek());
+		EXEC_COMMAND("punch",  4,  4, "", shell_punch());
+		EXEC_COMMAND("truncate", 3, 3, "", shell_truncate());
 		EXEC_COMMAND("mkdir",  2,  2, "", shell_mkdir());
 		EXEC_COMMAND("rmdir",  2,  2, "", shell_rmdir());
 		EXEC_COMMAND("cd",     2,  2, "", shell_cd());
 		EXEC_COMMAND("close",  2,  2, "", shell_close());
+		EXEC_COMMAND("fsync",  2,  2, "", shell_fsync());
+		EXEC_COMMAND("sync",   1,  1, "", shell_sync());
 		EXEC_COMMAND("link",   3,  3, "", shell_link());
 		EXEC_COMMAND("unlink", 2,  2, "", shell_unlink());
+		EXEC_COMMAND("clone",  3,  3, "", shell_clone());
 		EXEC_COMMAND("stat",   2,  2, "", shell_stat());
-		EXEC_COMMAND("fsck",   1,  1, "", shell_fsck());
+		EXEC_COMMAND("fsck",   1,  2, " [-r]", shell_fsck());
+		EXEC_COMMAND("reclaim", 1, 1, "", shell_reclaim());
+		EXEC_COMMAND("fstrim", 1,  1, "", shell_fstrim());
+		EXEC_COMMAND("resize", 2,  2, " MiB", shell_resize());
 		EXEC_COMMAND("ls",     1,  2, "", shell_ls());
 		EXEC_COMMAND("create", 3,  3, "", shell_create());
 		EXEC_COMMAND("cat",    2,  2, "", shell_cat());
+		EXEC_COMMAND("cp",     3,  3, "", shell_cp());
 		writeStr(argv[0]);
 		writeStr(" : Command not found.");
 		writeChar(RETURN);
@@ -129,6 +152,8 @@ static void readLine(void) {
 }
 
 static void shell_exit(void) {
+	// the cache holds data not written back yet
+	fs_umount(fs);
 	exit(0);
 }
 
@@ -141,7 +166,14 @@ static void shell_clearscreen(void) {
 }
 
 static void shell_mkfs(void) {
-	if (fs_mkfs() != 0)
+	fs_off_t size = (fs_off_t) FS_SIZE * BLOCK_SIZE;
+	int bytes_per_inode = FS_BYTES_PER_INODE;
+
+	if (argc > 1)
+		size = (fs_off_t) atoi(argv[1]) << 20;
+	if (argc > 2)
+		bytes_per_inode = atoi(argv[2]);
+	if (fs_mkfs_geometry(fs, size, bytes_per_inode) != 0)
 		writeStr("mkfs failed\n");
 }
 
@@ -149,17 +181,17 @@ static void shell_create(void) {
 	int fd, i, ret;
 	char letter[1];
 
-	if ((fd = fs_open(argv[1], FS_O_RDWR)) == -1)
+	if ((fd = fs_open(fs, argv[1], FS_O_RDWR)) == -1)
 		writeStr("Error creating file\n");
 	for(i=0; i < atoi(argv[2]); i++) {
 		letter[0] = 'A' + (i % 37);
 		if ((i+1) % 40 == 0) {
 			letter[0] = RETURN;
-			ret = fs_write(fd, letter, 1);
+			ret = fs_write(fs, fd, letter, 1);
 			if(ret <= 0)
 				break;
 		}else{
-			ret = fs_write(fd, letter, 1);
+			ret = fs_write(fs, fd, letter, 1);
 			if(ret <= 0)
 				break;
 		}
@@ -168,14 +200,14 @@ static void shell_create(void) {
 	if(ret == -1){
 		writeStr("Error writing file\n");
 	}
-	fs_close(fd);
+	fs_close(fs, fd);
 }
 
 static void shell_open(void) {
 	int i;
 	char s[10];
 	
-	if ((i = fs_open(argv[1], atoi(argv[2]))) == -1)
+	if ((i = fs_open(fs, argv[1], atoi(argv[2]))) == -1)
 		writeStr("Error while opening file\n");
 	else {
 		itoa(i, s);
@@ -194,7 +226,7 @@ static void shell_read(void) {
 		writeStr("Requested size too big\n");
 		return;
 	}
-	if ((count = fs_read(atoi(argv[1]), data, n)) == -1)
+	if ((count = fs_read(fs, atoi(argv[1]), data, n)) == -1)
 		writeStr("Read failed\n");
 	else {
 		writeStr("Data read in : ");
@@ -205,42 +237,70 @@ static void shell_read(void) {
 }
 
 static void shell_write(void) {
-	if (fs_write(atoi(argv[1]), argv[2], strlen(argv[2])) == -1)
+	if (fs_write(fs, atoi(argv[1]), argv[2], strlen(argv[2])) == -1)
 		writeStr("Error while writing file\n");
 	else
 		writeStr("Done\n");
 }
 
 static void shell_lseek(void) {
-	if (fs_lseek(atoi(argv[1]), atoi(argv[2])) == -1)
+	if (fs_lseek(fs, atoi(argv[1]), atoi(argv[2])) == -1)
 		writeStr("Problem with seeking\n");
 	else
 		writeStr("OK\n");
 }
 
+static void shell_punch(void) {
+	if (fs_punch_hole(fs, atoi(argv[1]), atoi(argv[2]), atoi(argv[3])) == -1)
+		writeStr("Problem with punching hole\n");
+	else
+		writeStr("OK\n");
+}
+
+static void shell_truncate(void) {
+	if (fs_truncate(fs, argv[1], atoi(argv[2])) == -1)
+		writeStr("Problem with truncating file\n");
+	else
+		writeStr("OK\n");
+}
+
 static void shell_close(void) {
-	if (fs_close(atoi(argv[1])) == -1)
+	if (fs_close(fs, atoi(argv[1])) == -1)
 		writeStr("Problem with closing file\n");
 	else
 		writeStr("OK\n");
 }
 
+static void shell_fsync(void) {
+	if (fs_fsync(fs, atoi(argv[1])) == -1)
+		writeStr("Problem with syncing file\n");
+	else
+		writeStr("OK\n");
+}
+
+static void shell_sync(void) {
+	if (fs_sync(fs) == -1)
+		writeStr("Problem with sync\n");
+	else
+		writeStr("OK\n");
+}
+
 static void shell_mkdir(void) {
-	if (fs_mkdir(argv[1]) == -1)
+	if (fs_mkdir(fs, argv[1]) == -1)
 		writeStr("Problem with making directory\n");
 	else
 		writeStr("OK\n");
 }
 
 static void shell_rmdir(void) {
-	if (fs_rmdir(argv[1]) == -1)
+	if (fs_rmdir(fs, argv[1]) == -1)
 		writeStr("Problem with removing directory\n");
 	else
 		writeStr("OK\n");
 }
 
 static void shell_cd(void) {
-	if (fs_cd(argv[1]) == -1)
+	if (fs_cd(fs, argv[1]) == -1)
 		writeStr("Problem with changing directory\n");
 	else
 		writeStr("OK\n");
@@ -249,22 +309,23 @@ static void shell_cd(void) {
 static void shell_ls(void) {
 	int i, j, k, current_iblock, sz_file_name;
 	DataBlock block;
+	mount_t *m = fs->mount;
 
-	inode_t dir_inode = get_inode_per_inum(current_dir.files_inum[0]);
+	inode_t dir_inode = get_inode_per_inum(m, fs->cwd);
 
-	int num_blocks = (dir_inode.size + super.pointers_per_dcb - 1) / super.pointers_per_dcb;
+	int num_blocks = (dir_inode.size + m->super.pointers_per_dcb - 1) / m->super.pointers_per_dcb;
 	for(i = 0; i < num_blocks; i++){
-		current_iblock = get_iblock(dir_inode, i);
+		current_iblock = get_iblock(m, dir_inode, i);
 		if(current_iblock < 0){
 			return;
 		}
 
-		block_read(super.beg_data + current_iblock, (char *) &block);
+		block_read(&m->dev, m->super.beg_data + current_iblock, (char *) &block);
 		for(j = 0; j < POINTERS_PER_DCB; j++){
 			if(block.dir.files_inum[j] == -1){
 				j = POINTERS_PER_DCB;
 			}else{
-				inode_t file_inode = get_inode_per_inum(block.dir.files_inum[j]);
+				inode_t file_inode = get_inode_per_inum(m, block.dir.files_inum[j]);
 
 				sz_file_name = strlen((char*)block.dir.files_name[j]);
 				writeStr((char*)block.dir.files_name[j]);
@@ -283,21 +344,26 @@ static void shell_ls(void) {
 }
 
 static void shell_link(void) {
-	if (fs_link(argv[1], argv[2]) == -1)
+	if (fs_link(fs, argv[1], argv[2]) == -1)
 		writeStr("Problem with link\n");
 }
 
 static void shell_unlink(void) {
-	if (fs_unlink(argv[1]) == -1)
+	if (fs_unlink(fs, argv[1]) == -1)
 		writeStr("Problem with unlink\n");
 }
 
+static void shell_clone(void) {
+	if (fs_clone(fs, argv[1], argv[2]) == -1)
+		writeStr("Problem with clone\n");
+}
+
 static void shell_stat(void) {
 	fileStat status;
 	int ret;
 	char s[10];
 	
-	ret = fs_stat(argv[1], &status);
+	ret = fs_stat(fs, argv[1], &status);
 	if (ret == 0) {
 		itoa(status.inodeNo, s);
 		writeStr("    Inode No         : "); writeStr(s); writeChar(RETURN);
@@ -316,20 +382,38 @@ static void shell_stat(void) {
 	}
 }
 
+// Prints a counter of fsck, if it is not zero
+static void fsck_count(char *what, int count) {
+	char s[10];
+
+	if(count == 0) return;
+	itoa(count, s);
+	writeStr("      "); writeStr(what); writeStr(" : "); writeStr(s); writeChar(RETURN);
+}
+
 static void shell_fsck(void){
 	fsCheck status;
 	char s[10];
+	int options = 0;
+
+	if(argc == 2){
+		if(!same_string(argv[1], "-r")){
+			usage(" [-r]");
+			return;
+		}
+		options = FS_FSCK_REPAIR;
+	}
 
-	if(fs_fsck(&status) < 0){
+	if(fs_fsck(fs, &status, options) < 0){
 		writeStr("Problem with fsck\n");
 	}else{
 		itohex(status.magic_number, s);
 		writeStr("    Magic Number     : 0x"); writeStr(s); writeChar(RETURN);
 		itoa(status.inodes_allocated, s);
 		writeStr("    Inodes allocated : "); writeStr(s); writeChar('/');
-		itoa(super.num_inodes, s);	writeStr(s); writeChar(RETURN);
+		itoa(fs->mount->super.num_inodes, s);	writeStr(s); writeChar(RETURN);
 		writeStr("    Inodes map       : ");
-		for(int i = 0; i < super.num_inodes; i++){
+		for(int i = 0; i < fs->mount->super.num_inodes && i < SHELL_MAP_BITS; i++){
 			if(i%64 == 0){ 
 				writeChar(RETURN); writeStr("      ");
 			}
@@ -341,9 +425,9 @@ static void shell_fsck(void){
 		writeChar(RETURN);
 		itoa(status.blocks_allocated, s);
 		writeStr("    Blocks allocated : "); writeStr(s); writeChar('/');
-		itoa(super.num_data_blocks, s);	writeStr(s); writeChar(RETURN);
+		itoa(fs->mount->super.num_data_blocks, s);	writeStr(s); writeChar(RETURN);
 		writeStr("    Blocks map       : ");
-		for(int i = 0; i < super.num_data_blocks; i++){
+		for(int i = 0; i < fs->mount->super.num_data_blocks && i < SHELL_MAP_BITS; i++){
 			if(i%64 == 0){ 
 				writeChar(RETURN); writeStr("      ");
 			}
@@ -353,6 +437,16 @@ static void shell_fsck(void){
 				writeChar('0');
 		}
 		writeChar(RETURN);
+		itoa(status.errors, s);
+		writeStr("    Errors           : "); writeStr(s);
+		writeStr(status.errors > 0 && options == FS_FSCK_REPAIR ? " (repaired)\n" : "\n");
+		fsck_count("Inodes map", status.bad_imap);
+		fsck_count("Blocks map", status.bad_dmap);
+		fsck_count("Reference counts", status.bad_refs);
+		fsck_count("Link counts", status.bad_links);
+		fsck_count("Block pointers", status.bad_pointers);
+		fsck_count("Entries", status.bad_entries);
+		fsck_count("Unreachable", status.unreachable);
 	}
 }
 
@@ -360,18 +454,67 @@ static void shell_cat(void) {
 	int fd, n, i;
 	char buf[256];
 	
-	fd = fs_open(argv[1], FS_O_RDONLY);
+	fd = fs_open(fs, argv[1], FS_O_RDONLY);
 	if (fd < 0) {
 		writeStr("Cat failed\n");
 		return;
 	}
 	
 	do {
-		n = fs_read(fd, buf, 256);
+		n = fs_read(fs, fd, buf, 256);
 		for (i = 0; i < n; i++) 
 			writeChar(buf[i]);
 	} while (n > 0);
-	fs_close(fd);
+	fs_close(fs, fd);
 	writeChar(RETURN);
 }
 
+static void shell_cp(void) {
+	int fd_in, fd_out, size;
+	fileStat status;
+
+	if (fs_stat(fs, argv[1], &status) == -1 || status.type != FILE_TYPE) {
+		writeStr("Copy failed\n");
+		return;
+	}
+	size = status.size;
+
+	if ((fd_in = fs_open(fs, argv[1], FS_O_RDONLY)) == -1) {
+		writeStr("Copy failed\n");
+		return;
+	}
+	if ((fd_out = fs_open(fs, argv[2], FS_O_WRONLY)) == -1) {
+		writeStr("Copy failed\n");
+		fs_close(fs, fd_in);
+		return;
+	}
+
+	// the data is copied inside the file system, without going through
+	// a buffer of the shell
+	if (size > 0 && fs_copy_range(fs, fd_in, 0, fd_out, 0, size) != size)
+		writeStr("Copy failed\n");
+	else
+		fs_ftruncate(fs, fd_out, size); // drop what was left of an older file
+
+	fs_close(fs, fd_in);
+	fs_close(fs, fd_out);
+}
+
+static void shell_reclaim(void) {
+	char s[10];
+
+	itoa(fs_reclaim(fs, -1), s);
+	writeStr("Orphans left : "); writeStr(s); writeChar(RETURN);
+}
+
+static void shell_fstrim(void) {
+	char s[10];
+
+	itoa(fs_trim(fs), s);
+	writeStr("Blocks trimmed : "); writeStr(s); writeChar(RETURN);
+}
+
+static void shell_resize(void) {
+	if (fs_resize(fs, (fs_off_t) atoi(argv[1]) << 20) != 0)
+		writeStr("resize failed\n");
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "util.h"
 #include "common.h"
 #include "fs.h"
@@ -6,8 +7,14 @@
 
 int system (const char *string );
 
+extern fs_t *fs;
+
 void shell_init(void) {
-	fs_init();
+	fs = fs_mount("./disk", FS_MOUNT_FORMAT);
+	if (fs == NULL) {
+		printf("Cannot mount ./disk\n");
+		exit(1);
+	}
 }
 
 void writeChar(int c) {